@@ -0,0 +1,211 @@
+#include <porter.hpp>
+#include <cmdline.hpp>
+#include <thread>
+#include <vector>
+
+#include "bench_util.hpp"
+
+/*! \brief stream `count` messages of `size` bytes through `porter`,
+ *  the consumer drains up to `batch` buffers per `readBatch` /
+ *  `consumeN` pair (batch 1 uses plain `read` / `consume`)
+ *  \return elapsed seconds
+ */
+double runBatch(Porter& porter, std::size_t size, std::size_t count, std::size_t batch){
+  std::vector<char> message(size, 'x');
+  std::vector<Item> items(batch);
+  Clock::time_point start = Clock::now();
+  std::thread prod([&] {
+    for(std::size_t i = 0; i < count; ++i){
+      porter.write(message.data(), size);
+    }
+  });
+  std::size_t checksum = 0;
+  for(std::size_t i = 0; i < count;){
+    std::size_t n = 1;
+    if(batch == 1){
+      porter.read(&items[0].buffer, items[0].size);
+    }else{
+      n = porter.readBatch(items.data(), batch);
+    }
+    for(std::size_t j = 0; j < n; ++j){
+      checksum += static_cast<char*>(items[j].buffer)[0] + items[j].size;
+    }
+    if(batch == 1){
+      porter.consume();
+    }else{
+      porter.consumeN(n);
+    }
+    i += n;
+  }
+  prod.join();
+  double seconds = secondsSince(start);
+  if(checksum != count * ('x' + size)){
+    std::cerr << "Error: checksum mismatch" << std::endl;
+  }
+  return seconds;
+}
+
+/*! \brief the producer builds every message before sending it,
+ *  then either copies it in with `write` or hands it over
+ */
+double runAdopt(Porter& porter, std::size_t size, std::size_t count, bool adopt){
+  Clock::time_point start = Clock::now();
+  std::thread prod([&] {
+    std::vector<char> message(size);
+    for(std::size_t i = 0; i < count; ++i){
+      if(adopt){
+        std::unique_ptr<char[]> built(new char[size]);
+        memset(built.get(), 'x', size);
+        porter.write(std::move(built), size);
+      }else{
+        memset(message.data(), 'x', size);
+        porter.write(message.data(), size);
+      }
+    }
+  });
+  std::size_t checksum = 0;
+  void* buffer = nullptr;
+  std::size_t recv = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    porter.read(&buffer, recv);
+    checksum += static_cast<char*>(buffer)[0] + recv;
+    porter.consume();
+  }
+  prod.join();
+  double seconds = secondsSince(start);
+  if(checksum != count * ('x' + size)){
+    std::cerr << "Error: checksum mismatch" << std::endl;
+  }
+  return seconds;
+}
+
+/*! \brief one producer feeding `consumers` workers that each spend
+ *  about `work` ns on a message; every worker stops at the first end
+ *  marker it reads
+ */
+double runWorkers(std::size_t budget, std::size_t consumers, std::size_t size,
+                  std::size_t count, std::chrono::nanoseconds work){
+  PorterOptions options;
+  options.consumers = consumers;
+  Porter porter(options);
+  porter.resize(budget);
+  std::vector<char> message(size, 'x');
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> workers;
+  std::atomic<std::size_t> checksum(0);
+  for(std::size_t c = 0; c < consumers; ++c){
+    workers.emplace_back([&, c] {
+      std::size_t sum = 0;
+      void* buffer = nullptr;
+      std::size_t recv = 0;
+      while(true){
+        porter.read(c, &buffer, recv);
+        if(recv == 0){
+          porter.consume(c);
+          break;
+        }
+        sum += static_cast<char*>(buffer)[0] + recv;
+        Clock::time_point until = Clock::now() + work;
+        while(Clock::now() < until){
+        }
+        porter.consume(c);
+      }
+      checksum += sum;
+    });
+  }
+  for(std::size_t i = 0; i < count; ++i){
+    porter.write(message.data(), size);
+  }
+  char end = 0;
+  for(std::size_t c = 0; c < consumers; ++c){
+    porter.write(&end, 0);
+  }
+  for(std::thread& worker : workers){
+    worker.join();
+  }
+  double seconds = secondsSince(start);
+  if(checksum != count * ('x' + size)){
+    std::cerr << "Error: checksum mismatch" << std::endl;
+  }
+  return seconds;
+}
+
+/*! \brief one-way latency of timestamps sent at a moderate rate,
+ *  with `strategy` on both sides
+ */
+std::vector<std::int64_t> runLatency(std::size_t budget, WaitStrategy strategy,
+                                     std::size_t count, std::chrono::microseconds gap){
+  PorterOptions options;
+  options.wait = strategy;
+  Porter porter(options);
+  porter.resize(budget);
+  return measureLatency(count, gap,
+      [&](std::int64_t stamp) { porter.write(&stamp, sizeof(stamp)); },
+      [&]() {
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        porter.read(&buffer, size);
+        std::int64_t stamp = *static_cast<std::int64_t*>(buffer);
+        porter.consume();
+        return stamp;
+      });
+}
+
+int main(int argc, char* argv[]){
+  cmdline::parser args;
+  args.add<std::size_t>("budget", 'b', "porter memory budget in bytes", false, 1 << 25);
+  args.add<std::size_t>("count", 'n', "messages per run", false, 1 << 20);
+  args.add<std::size_t>("size", 's', "message size", false, 64);
+  args.add<std::string>("batches", 'B', "comma separated readBatch sizes", false, "1,4,16,64,256,1024");
+  args.add<std::size_t>("large", 'l', "message size for the placement runs", false, 2 << 20);
+  args.add<std::string>("consumers", 'c', "comma separated worker counts", false, "1,2,4,8");
+  args.add<std::size_t>("work", 'w', "nanoseconds a worker spends per message", false, 1000);
+  args.add<std::size_t>("latency", 'L', "messages per latency run", false, 20000);
+  args.add<std::size_t>("gap", 'g', "microseconds between latency messages", false, 20);
+  args.parse_check(argc, argv);
+
+  std::size_t budget = args.get<std::size_t>("budget");
+  std::size_t count = args.get<std::size_t>("count");
+  std::size_t size = args.get<std::size_t>("size");
+  std::vector<std::size_t> batches = parseList(args.get<std::string>("batches"));
+
+  for(std::size_t batch : batches){
+    Porter porter;
+    porter.resize(budget);
+    std::string name = "batch=" + std::to_string(batch);
+    report(name.c_str(), size, count, runBatch(porter, size, count, batch));
+  }
+
+  // placement only applies to large buffers
+  printf("\n");
+  std::size_t large = args.get<std::size_t>("large");
+  std::size_t large_count = count * size / large + 1;
+  for(const std::pair<std::string, MemPlacement>& placed : placements()){
+    Porter porter(placed.second);
+    porter.resize(budget);
+    report(placed.first.c_str(), large, large_count, runBatch(porter, large, large_count, 1));
+  }
+
+  printf("\n");
+  for(bool adopt : {false, true}){
+    Porter porter;
+    porter.resize(budget);
+    report(adopt ? "adopt" : "copy", large, large_count, runAdopt(porter, large, large_count, adopt));
+  }
+
+  printf("\n");
+  std::chrono::nanoseconds work(args.get<std::size_t>("work"));
+  for(std::size_t consumers : parseList(args.get<std::string>("consumers"))){
+    std::string name = "workers=" + std::to_string(consumers);
+    report(name.c_str(), size, count, runWorkers(budget, consumers, size, count, work));
+  }
+
+  printf("\n");
+  std::chrono::microseconds gap(args.get<std::size_t>("gap"));
+  for(const std::pair<std::string, WaitStrategy>& strategy : strategies()){
+    std::vector<std::int64_t> latencies =
+        runLatency(budget, strategy.second, args.get<std::size_t>("latency"), gap);
+    reportLatency(strategy.first.c_str(), latencies);
+  }
+  return 0;
+}
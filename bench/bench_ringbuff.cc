@@ -0,0 +1,432 @@
+#include <ringbuff.hpp>
+#include <typedring.hpp>
+#include <cmdline.hpp>
+#include <vector>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "bench_util.hpp"
+#include "locked_ringbuff.hpp"
+
+/*! \brief stream `count` messages of `size` bytes through `ring`
+ *  from one producer thread to one consumer thread
+ *  \return elapsed seconds
+ */
+template <typename Ring>
+double run(Ring& ring, std::size_t size, std::size_t count){
+  std::vector<char> message(size, 'x');
+  Clock::time_point start = Clock::now();
+  std::thread prod([&] {
+    for(std::size_t i = 0; i < count; ++i){
+      ring.write(message.data(), size);
+    }
+  });
+  std::size_t checksum = 0;
+  void* buffer = nullptr;
+  std::size_t recv = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    ring.read(&buffer, recv);
+    checksum += static_cast<char*>(buffer)[0] + recv;
+    ring.consume();
+  }
+  prod.join();
+  double seconds = secondsSince(start);
+  if(checksum != count * ('x' + size)){
+    std::cerr << "Error: checksum mismatch" << std::endl;
+  }
+  return seconds;
+}
+
+/*! \brief same as `run` but the consumer drains up to `batch`
+ *  records per `readBatch` / `consumeN` pair
+ */
+double runBatch(RingBuffer& ring, std::size_t size, std::size_t count, std::size_t batch){
+  std::vector<char> message(size, 'x');
+  std::vector<RingRecord> records(batch);
+  Clock::time_point start = Clock::now();
+  std::thread prod([&] {
+    for(std::size_t i = 0; i < count; ++i){
+      ring.write(message.data(), size);
+    }
+  });
+  std::size_t checksum = 0;
+  for(std::size_t i = 0; i < count;){
+    std::size_t n = ring.readBatch(records.data(), batch);
+    for(std::size_t j = 0; j < n; ++j){
+      checksum += static_cast<char*>(records[j].buffer)[0] + records[j].size;
+    }
+    ring.consumeN(n);
+    i += n;
+  }
+  prod.join();
+  double seconds = secondsSince(start);
+  if(checksum != count * ('x' + size)){
+    std::cerr << "Error: checksum mismatch" << std::endl;
+  }
+  return seconds;
+}
+
+/*! \brief `producers` threads share `count` messages of `size`
+ *  bytes on a multi-producer ring, one thread consumes them
+ */
+double runMulti(RingBuffer& ring, std::size_t size, std::size_t count, std::size_t producers){
+  std::vector<char> message(size, 'x');
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> prods;
+  for(std::size_t p = 0; p < producers; ++p){
+    prods.emplace_back([&, p] {
+      for(std::size_t i = p; i < count; i += producers){
+        ring.write(message.data(), size);
+      }
+    });
+  }
+  void* buffer = nullptr;
+  std::size_t recv = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    ring.read(&buffer, recv);
+    ring.consume();
+  }
+  for(std::thread& prod : prods){
+    prod.join();
+  }
+  return secondsSince(start);
+}
+
+/*! \brief fan `count` messages out to `readers` consumer threads,
+ *  either through one broadcast ring or by writing every message
+ *  into one ring per reader
+ */
+double runFanout(std::size_t buffer_size, std::size_t size, std::size_t count,
+                 std::size_t readers, bool broadcast){
+  std::vector<char> message(size, 'x');
+  std::vector<std::unique_ptr<RingBuffer>> rings;
+  if(broadcast){
+    RingOptions options;
+    options.readers = readers;
+    rings.emplace_back(new RingBuffer(buffer_size, options));
+  }else{
+    for(std::size_t r = 0; r < readers; ++r){
+      rings.emplace_back(new RingBuffer(buffer_size));
+    }
+  }
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> threads;
+  for(std::size_t r = 0; r < readers; ++r){
+    threads.emplace_back([&, r] {
+      RingBuffer& ring = broadcast ? *rings[0] : *rings[r];
+      std::size_t reader = broadcast ? r : 0;
+      void* buffer = nullptr;
+      std::size_t recv = 0;
+      for(std::size_t i = 0; i < count; ++i){
+        ring.read(reader, &buffer, recv);
+        ring.consume(reader);
+      }
+    });
+  }
+  for(std::size_t i = 0; i < count; ++i){
+    for(std::size_t r = 0; r < rings.size(); ++r){
+      rings[r]->write(message.data(), size);
+    }
+  }
+  for(std::thread& t : threads){
+    t.join();
+  }
+  return secondsSince(start);
+}
+
+template <std::size_t N>
+struct Message {
+  char data[N];
+};
+
+/*! \brief same as `run` on a `TypedRing` of `N`-byte messages */
+template <std::size_t N, std::size_t Capacity>
+double runTyped(TypedRing<Message<N>, Capacity>& ring, std::size_t count){
+  Message<N> message;
+  memset(message.data, 'x', N);
+  Clock::time_point start = Clock::now();
+  std::thread prod([&] {
+    for(std::size_t i = 0; i < count; ++i){
+      ring.push(message);
+    }
+  });
+  std::size_t checksum = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    checksum += ring.read().data[0] + N;
+    ring.consume();
+  }
+  prod.join();
+  double seconds = secondsSince(start);
+  if(checksum != count * ('x' + N)){
+    std::cerr << "Error: checksum mismatch" << std::endl;
+  }
+  return seconds;
+}
+
+/*! \brief `N`-byte messages through the byte ring and a typed ring
+ *  holding the same number of records
+ */
+template <std::size_t N>
+void compareTyped(std::size_t count){
+  const std::size_t kSlots = 1 << 16;
+  {
+    RingBuffer ring(kSlots * (sizeof(std::uint64_t) + N));
+    report("bytes", N, count, run(ring, N, count));
+  }
+  {
+    std::unique_ptr<TypedRing<Message<N>, kSlots>> ring(new TypedRing<Message<N>, kSlots>());
+    report("typed", N, count, runTyped(*ring, count));
+  }
+}
+
+/*! \brief byte sum of `size` bytes, 16 at a time
+ *  Takes the aligned load when `data` allows it, like a consumer
+ *  specialized for aligned records would.
+ */
+std::size_t sumBytes(const void* data, std::size_t size){
+  const char* bytes = static_cast<const char*>(data);
+  std::size_t sum = 0;
+  std::size_t i = 0;
+#ifdef __SSE2__
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  if(reinterpret_cast<std::uintptr_t>(bytes) % 16 == 0){
+    for(; i + 16 <= size; i += 16){
+      __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(bytes + i));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+  }else{
+    for(; i + 16 <= size; i += 16){
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i));
+      acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+    }
+  }
+  sum = _mm_cvtsi128_si64(acc) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+#endif
+  for(; i < size; ++i){
+    sum += static_cast<unsigned char>(bytes[i]);
+  }
+  return sum;
+}
+
+/*! \brief `run` with a consumer that reads every payload byte with
+ *  vector loads, on a ring whose payloads start at `align`
+ */
+double runSimd(std::size_t buffer_size, std::size_t align, std::size_t size,
+               std::size_t count){
+  RingOptions options;
+  options.align = align;
+  RingBuffer ring(buffer_size, options);
+  std::vector<char> message(size, 'x');
+  Clock::time_point start = Clock::now();
+  std::thread prod([&] {
+    for(std::size_t i = 0; i < count; ++i){
+      ring.write(message.data(), size);
+    }
+  });
+  std::size_t checksum = 0;
+  void* buffer = nullptr;
+  std::size_t recv = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    ring.read(&buffer, recv);
+    checksum += sumBytes(buffer, recv);
+    ring.consume();
+  }
+  prod.join();
+  double seconds = secondsSince(start);
+  if(checksum != count * size * 'x'){
+    std::cerr << "Error: checksum mismatch" << std::endl;
+  }
+  return seconds;
+}
+
+/*! \brief pass `count` chunks of `size` bytes from one pipe to
+ *  another through `ring`, either staged through user buffers with
+ *  `write` / `read` or with `fillFromFd` / `drainToFd`
+ */
+double runPassThrough(RingBuffer& ring, std::size_t size, std::size_t count, bool direct){
+  int in[2];
+  int out[2];
+  if(pipe(in) != 0 || pipe(out) != 0){
+    std::cerr << "Error: pipe failed" << std::endl;
+    return 0;
+  }
+  std::size_t total = size * count;
+  Clock::time_point start = Clock::now();
+  std::thread feeder([&] {
+    std::vector<char> message(size, 'x');
+    for(std::size_t i = 0; i < count; ++i){
+      for(std::size_t ofs = 0; ofs < size;){
+        ofs += std::max<ssize_t>(::write(in[1], message.data() + ofs, size - ofs), 0);
+      }
+    }
+    close(in[1]);
+  });
+  std::thread sink([&] {
+    std::vector<char> buffer(1 << 16);
+    while(::read(out[0], buffer.data(), buffer.size()) > 0){
+    }
+  });
+  std::thread filler([&] {
+    std::vector<char> staging(size);
+    ssize_t n = 0;
+    while(true){
+      if(direct){
+        n = ring.fillFromFd(in[0], size);
+      }else if((n = ::read(in[0], staging.data(), size)) > 0){
+        ring.write(staging.data(), n);
+      }
+      if(n <= 0){
+        break;
+      }
+    }
+  });
+  void* buffer = nullptr;
+  std::size_t recv = 0;
+  for(std::size_t drained = 0; drained < total;){
+    if(direct){
+      drained += std::max<ssize_t>(ring.drainToFd(out[1]), 0);
+      continue;
+    }
+    ring.read(&buffer, recv);
+    for(std::size_t ofs = 0; ofs < recv;){
+      ofs += std::max<ssize_t>(::write(out[1], static_cast<char*>(buffer) + ofs, recv - ofs), 0);
+    }
+    ring.consume();
+    drained += recv;
+  }
+  close(out[1]);
+  feeder.join();
+  filler.join();
+  sink.join();
+  close(in[0]);
+  close(out[0]);
+  return secondsSince(start);
+}
+
+/*! \brief one-way latency of timestamp records sent at a
+ *  moderate rate, with `strategy` on both sides
+ */
+std::vector<std::int64_t> runLatency(std::size_t buffer_size, WaitStrategy strategy,
+                                     std::size_t count, std::chrono::microseconds gap){
+  RingOptions options;
+  options.wait = strategy;
+  RingBuffer ring(buffer_size, options);
+  return measureLatency(count, gap,
+      [&](std::int64_t stamp) { ring.write(&stamp, sizeof(stamp)); },
+      [&]() {
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        ring.read(&buffer, size);
+        std::int64_t stamp = *static_cast<std::int64_t*>(buffer);
+        ring.consume();
+        return stamp;
+      });
+}
+
+int main(int argc, char* argv[]){
+  cmdline::parser args;
+  args.add<std::size_t>("buffer", 'b', "ring buffer size in bytes", false, 1 << 25);
+  args.add<std::size_t>("count", 'n', "messages per run", false, 1 << 20);
+  args.add<std::string>("sizes", 's', "comma separated message sizes", false, "16,64,256,1024,4096");
+  args.add<std::string>("batches", 'B', "comma separated readBatch sizes", false, "1,4,16,64,256,1024");
+  args.add<std::string>("producers", 'p', "comma separated producer counts", false, "1,2,4,8,16");
+  args.add<std::string>("readers", 'r', "comma separated broadcast reader counts", false, "1,2,4");
+  args.add<std::string>("aligns", 'a', "comma separated payload alignments", false, "8,16,64,4096");
+  args.add<std::size_t>("latency", 'L', "messages per latency run", false, 20000);
+  args.add<std::size_t>("gap", 'g', "microseconds between latency messages", false, 20);
+  args.parse_check(argc, argv);
+
+  std::size_t buffer_size = args.get<std::size_t>("buffer");
+  std::size_t count = args.get<std::size_t>("count");
+  std::vector<std::size_t> sizes = parseList(args.get<std::string>("sizes"));
+  std::vector<std::size_t> batches = parseList(args.get<std::string>("batches"));
+  std::vector<std::size_t> producers = parseList(args.get<std::string>("producers"));
+  std::vector<std::size_t> readers = parseList(args.get<std::string>("readers"));
+  std::vector<std::size_t> aligns = parseList(args.get<std::string>("aligns"));
+
+  for(std::size_t size : sizes){
+    {
+      LockedRingBuffer ring(buffer_size);
+      report("locked", size, count, run(ring, size, count));
+    }
+    {
+      RingBuffer ring(buffer_size);
+      report("lockfree", size, count, run(ring, size, count));
+    }
+    {
+      RingOptions options;
+      options.backend = RingBackend::kMirrored;
+      RingBuffer ring(buffer_size, options);
+      report("mirrored", size, count, run(ring, size, count));
+    }
+  }
+
+  printf("\n");
+  compareTyped<16>(count);
+  compareTyped<64>(count);
+  compareTyped<256>(count);
+
+  printf("\n");
+  for(std::size_t size : {std::size_t(200), std::size_t(4000)}){
+    for(std::size_t align : aligns){
+      std::string name = "simd/" + std::to_string(align);
+      report(name.c_str(), size, count, runSimd(buffer_size, align, size, count));
+    }
+  }
+
+  printf("\n");
+  for(std::size_t size : {std::size_t(4096), std::size_t(65536)}){
+    {
+      RingBuffer ring(buffer_size);
+      report("fd staged", size, count / 16, runPassThrough(ring, size, count / 16, false));
+    }
+    {
+      RingBuffer ring(buffer_size);
+      report("fd direct", size, count / 16, runPassThrough(ring, size, count / 16, true));
+    }
+  }
+
+  printf("\n");
+  for(std::size_t batch : batches){
+    RingBuffer ring(buffer_size);
+    std::string name = "batch=" + std::to_string(batch);
+    report(name.c_str(), 64, count, runBatch(ring, 64, count, batch));
+  }
+
+  printf("\n");
+  for(std::size_t n : producers){
+    RingOptions options;
+    options.multi_producer = true;
+    RingBuffer ring(buffer_size, options);
+    std::string name = "mpsc=" + std::to_string(n);
+    report(name.c_str(), 64, count, runMulti(ring, 64, count, n));
+  }
+
+  printf("\n");
+  for(const std::pair<std::string, MemPlacement>& placed : placements()){
+    RingOptions options;
+    options.placement = placed.second;
+    RingBuffer ring(buffer_size, options);
+    report(placed.first.c_str(), 4096, count, run(ring, 4096, count));
+  }
+
+  printf("\n");
+  for(std::size_t n : readers){
+    std::string name = "copy=" + std::to_string(n);
+    report(name.c_str(), 1024, count, runFanout(buffer_size, 1024, count, n, false));
+    name = "broadcast=" + std::to_string(n);
+    report(name.c_str(), 1024, count, runFanout(buffer_size, 1024, count, n, true));
+  }
+
+  printf("\n");
+  std::chrono::microseconds gap(args.get<std::size_t>("gap"));
+  for(const std::pair<std::string, WaitStrategy>& strategy : strategies()){
+    std::vector<std::int64_t> latencies =
+        runLatency(buffer_size, strategy.second, args.get<std::size_t>("latency"), gap);
+    reportLatency(strategy.first.c_str(), latencies);
+  }
+  return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef _BENCH_UTIL_H_
+#define _BENCH_UTIL_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+#include <utility>
+
+#include <memplace.hpp>
+#include <waitstrategy.hpp>
+
+typedef std::chrono::steady_clock Clock;
+
+inline double secondsSince(Clock::time_point start){
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+/*! \brief parse a comma separated list of numbers, e.g. "16,64,256" */
+inline std::vector<std::size_t> parseList(const std::string& list){
+  std::vector<std::size_t> values;
+  std::size_t pos = 0;
+  while(pos < list.size()){
+    std::size_t next = list.find(',', pos);
+    if(next == std::string::npos){
+      next = list.size();
+    }
+    values.push_back(std::stoul(list.substr(pos, next - pos)));
+    pos = next + 1;
+  }
+  return values;
+}
+
+/*! \brief the buffer placements compared by the benchmarks */
+inline std::vector<std::pair<std::string, MemPlacement>> placements(){
+  std::vector<std::pair<std::string, MemPlacement>> list;
+  MemPlacement placement;
+  list.push_back(std::make_pair("4k", placement));
+  placement.prefault = true;
+  list.push_back(std::make_pair("4k+fault", placement));
+  placement.prefault = false;
+  placement.huge_pages = HugePages::kTransparent;
+  list.push_back(std::make_pair("thp", placement));
+  placement.prefault = true;
+  list.push_back(std::make_pair("thp+fault", placement));
+  placement.huge_pages = HugePages::kExplicit;
+  list.push_back(std::make_pair("huge+fault", placement));
+  placement.numa_node = currentNumaNode();
+  list.push_back(std::make_pair("huge+numa", placement));
+  return list;
+}
+
+/*! \brief the wait strategies compared by the latency runs */
+inline std::vector<std::pair<std::string, WaitStrategy>> strategies(){
+  std::vector<std::pair<std::string, WaitStrategy>> list;
+  list.push_back(std::make_pair("blocking", WaitStrategy::kBlocking));
+  list.push_back(std::make_pair("spin", WaitStrategy::kSpin));
+  list.push_back(std::make_pair("spin-yield", WaitStrategy::kSpinYield));
+  list.push_back(std::make_pair("spin-futex", WaitStrategy::kSpinFutex));
+  return list;
+}
+
+inline std::int64_t nowNs(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Clock::now().time_since_epoch()).count();
+}
+
+/*! \brief send `count` timestamps through `send`, one every `gap`,
+ *  and collect the one-way latency of each seen by `recv`
+ *  \return latencies in ns
+ */
+template <typename Send, typename Recv>
+std::vector<std::int64_t> measureLatency(std::size_t count, std::chrono::microseconds gap,
+                                         Send send, Recv recv){
+  std::vector<std::int64_t> latencies;
+  latencies.reserve(count);
+  std::thread prod([&] {
+    for(std::size_t i = 0; i < count; ++i){
+      send(nowNs());
+      std::this_thread::sleep_for(gap);
+    }
+  });
+  for(std::size_t i = 0; i < count; ++i){
+    std::int64_t stamp = recv();
+    latencies.push_back(nowNs() - stamp);
+  }
+  prod.join();
+  return latencies;
+}
+
+inline void reportLatency(const char* name, std::vector<std::int64_t>& latencies){
+  std::sort(latencies.begin(), latencies.end());
+  std::size_t n = latencies.size();
+  printf("%-12s p50=%8.2f us  p99=%8.2f us  p999=%8.2f us\n", name,
+         latencies[n / 2] / 1e3, latencies[n * 99 / 100] / 1e3,
+         latencies[n * 999 / 1000] / 1e3);
+}
+
+inline void report(const char* name, std::size_t size, std::size_t count, double seconds){
+  printf("%-12s size=%6zu  %10.0f msgs/s  %9.1f MB/s\n", name, size,
+         count / seconds, count * size / seconds / (1 << 20));
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef _LOCKED_RINGBUFF_H_
+#define _LOCKED_RINGBUFF_H_
+
+#include <iostream>
+#include <cstdlib>
+#include <queue>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+
+#include <safequeue.hpp>
+
+
+/*! \brief the mutex + SafeQueue RingBuffer this repo shipped before
+ *  the lock-free rewrite. Kept only as a baseline for bench_ringbuff.
+ */
+class LockedRingBuffer{
+
+ public:
+
+  LockedRingBuffer(const LockedRingBuffer&) = delete;
+  LockedRingBuffer& operator=(const LockedRingBuffer&) = delete;
+
+  explicit LockedRingBuffer(std::size_t buffer_size)
+      : buffer_size_(buffer_size),
+        ofs_reader_(0),
+        ofs_consumer_(0),
+        ofs_writer_(0),
+        buffer_(std::malloc(buffer_size)) {
+    if(!buffer_){
+      throw std::bad_alloc();
+    }
+  }
+
+  ~LockedRingBuffer(){
+    std::free(buffer_);
+  }
+
+  void write(const void* buffer, std::size_t size){
+    if(size > buffer_size_){
+      std::cerr << "Error: buffer size too large" << std::endl;
+      return;
+    }
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    while(ofs_writer_ + size - ofs_consumer_ > buffer_size_){
+      not_full_.wait(lock);
+    }
+    lock.unlock();
+
+    std::size_t real_ofs = ofs_writer_ % buffer_size_;
+    std::size_t remain = buffer_size_ - real_ofs;
+    if(remain <= size){
+      ofs_writer_ += remain;
+      real_ofs = 0;
+      wait_read_.push(remain);
+    }
+    ofs_writer_ += size;
+    memcpy((void*)((char*)buffer_ + real_ofs), buffer, size);
+    wait_read_.push(size);
+  }
+
+  void read(void** buffer, std::size_t& size){
+    wait_read_.fpop(size);
+    ofs_reader_ = ofs_reader_ % buffer_size_;
+
+    if(ofs_reader_ + size == buffer_size_){
+      ofs_reader_ = 0;
+
+      std::unique_lock<std::mutex> lock(mtx_);
+      ofs_consumer_ += size;
+      lock.unlock();
+
+      not_full_.notify_one();
+      wait_read_.fpop(size);
+    }
+
+    *buffer = (void*)((char*)buffer_ + ofs_reader_);
+    wait_consume_.push(size);
+    ofs_reader_ += size;
+  }
+
+  void consume(){
+    if(wait_consume_.empty()){
+      std::cerr << "Error: consume call and read call number should match" << std::endl;
+      return;
+    }
+    std::size_t size = wait_consume_.front();
+
+    std::unique_lock<std::mutex> lock(mtx_);
+    ofs_consumer_ += size;
+    not_full_.notify_one();
+    lock.unlock();
+
+    wait_consume_.pop();
+  }
+
+ private:
+
+  std::size_t buffer_size_;
+
+  std::mutex mtx_;
+  std::condition_variable not_full_;
+
+  std::size_t ofs_reader_;
+  std::size_t ofs_consumer_;
+  std::size_t ofs_writer_;
+
+  SafeQueue<std::size_t> wait_read_;
+  std::queue<std::size_t> wait_consume_;
+
+  void* buffer_;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef _CHANNELSTATS_H_
+#define _CHANNELSTATS_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// build with -DCHANNEL_STATS=0 to compile every counter out
+#ifndef CHANNEL_STATS
+#define CHANNEL_STATS 1
+#endif
+
+// log2 buckets of blocked time: bucket i counts waits of less than
+// 2^i ns, the last one everything longer
+static const std::size_t kStallBuckets = 32;
+
+/*! \brief point-in-time copy of one channel's counters
+ *  Bytes count payload only. A channel that can't tell leaves a
+ *  counter at 0, so does a build with `CHANNEL_STATS` 0.
+ */
+struct ChannelStats {
+  std::uint64_t bytes_in;
+  std::uint64_t records_in;
+  std::uint64_t bytes_out;
+  std::uint64_t records_out;
+  // time and number of writes / reads that had to wait
+  std::uint64_t write_wait_ns;
+  std::uint64_t write_waits;
+  std::uint64_t read_wait_ns;
+  std::uint64_t read_waits;
+  std::uint64_t write_wait_hist[kStallBuckets];
+  std::uint64_t read_wait_hist[kStallBuckets];
+  // most bytes (records for a queue) seen buffered at once
+  std::uint64_t high_water;
+  // notifies that had to wake a sleeper or signal an eventfd
+  std::uint64_t wakeups;
+  // space skipped at the end of a ring buffer by wrapping records
+  std::uint64_t padding_bytes;
+};
+
+/*! \brief live counters behind `ChannelStats`
+ *  Relaxed atomics, producer and consumer counters on their own
+ *  cache lines. Wait times are only measured once a side leaves its
+ *  fast path, so a channel that never blocks pays a few uncontended
+ *  increments per record.
+ */
+class ChannelCounters {
+
+ public:
+
+  typedef std::chrono::steady_clock Clock;
+
+  ChannelCounters(const ChannelCounters&) = delete;
+  ChannelCounters& operator=(const ChannelCounters&) = delete;
+
+  ChannelCounters() {
+    reset();
+  }
+
+  void in(std::size_t bytes, std::size_t records = 1) {
+#if CHANNEL_STATS
+    bytes_in_.fetch_add(bytes, std::memory_order_relaxed);
+    records_in_.fetch_add(records, std::memory_order_relaxed);
+#else
+    (void)bytes; (void)records;
+#endif
+  }
+
+  void out(std::size_t bytes, std::size_t records = 1) {
+#if CHANNEL_STATS
+    bytes_out_.fetch_add(bytes, std::memory_order_relaxed);
+    records_out_.fetch_add(records, std::memory_order_relaxed);
+#else
+    (void)bytes; (void)records;
+#endif
+  }
+
+  void padding(std::size_t bytes) {
+#if CHANNEL_STATS
+    padding_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+#else
+    (void)bytes;
+#endif
+  }
+
+  void occupancy(std::size_t used) {
+#if CHANNEL_STATS
+    std::uint64_t high = high_water_.load(std::memory_order_relaxed);
+    while(used > high &&
+          !high_water_.compare_exchange_weak(high, used, std::memory_order_relaxed)){
+    }
+#else
+    (void)used;
+#endif
+  }
+
+  void writeWaited(Clock::duration waited) {
+    stalled(waited, write_wait_ns_, write_waits_, write_wait_hist_);
+  }
+
+  void readWaited(Clock::duration waited) {
+    stalled(waited, read_wait_ns_, read_waits_, read_wait_hist_);
+  }
+
+  /*! \brief copy of the counters, callable from any thread
+   *  Counters are read one by one, not as a consistent set.
+   */
+  ChannelStats snapshot() const {
+    ChannelStats s;
+    s.bytes_in = bytes_in_.load(std::memory_order_relaxed);
+    s.records_in = records_in_.load(std::memory_order_relaxed);
+    s.bytes_out = bytes_out_.load(std::memory_order_relaxed);
+    s.records_out = records_out_.load(std::memory_order_relaxed);
+    s.write_wait_ns = write_wait_ns_.load(std::memory_order_relaxed);
+    s.write_waits = write_waits_.load(std::memory_order_relaxed);
+    s.read_wait_ns = read_wait_ns_.load(std::memory_order_relaxed);
+    s.read_waits = read_waits_.load(std::memory_order_relaxed);
+    for(std::size_t i = 0; i < kStallBuckets; ++i){
+      s.write_wait_hist[i] = write_wait_hist_[i].load(std::memory_order_relaxed);
+      s.read_wait_hist[i] = read_wait_hist_[i].load(std::memory_order_relaxed);
+    }
+    s.high_water = high_water_.load(std::memory_order_relaxed);
+    s.wakeups = 0;
+    s.padding_bytes = padding_bytes_.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  void reset() {
+    bytes_in_.store(0, std::memory_order_relaxed);
+    records_in_.store(0, std::memory_order_relaxed);
+    bytes_out_.store(0, std::memory_order_relaxed);
+    records_out_.store(0, std::memory_order_relaxed);
+    write_wait_ns_.store(0, std::memory_order_relaxed);
+    write_waits_.store(0, std::memory_order_relaxed);
+    read_wait_ns_.store(0, std::memory_order_relaxed);
+    read_waits_.store(0, std::memory_order_relaxed);
+    for(std::size_t i = 0; i < kStallBuckets; ++i){
+      write_wait_hist_[i].store(0, std::memory_order_relaxed);
+      read_wait_hist_[i].store(0, std::memory_order_relaxed);
+    }
+    high_water_.store(0, std::memory_order_relaxed);
+    padding_bytes_.store(0, std::memory_order_relaxed);
+  }
+
+ private:
+
+  static const std::size_t kCacheLine = 64;
+
+  static void stalled(Clock::duration waited, std::atomic<std::uint64_t>& total,
+                      std::atomic<std::uint64_t>& count,
+                      std::atomic<std::uint64_t>* hist) {
+#if CHANNEL_STATS
+    std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count();
+    std::size_t bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if(bucket >= kStallBuckets){
+      bucket = kStallBuckets - 1;
+    }
+    total.fetch_add(ns, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    hist[bucket].fetch_add(1, std::memory_order_relaxed);
+#else
+    (void)waited; (void)total; (void)count; (void)hist;
+#endif
+  }
+
+  // producer side
+  std::atomic<std::uint64_t> bytes_in_;
+  std::atomic<std::uint64_t> records_in_;
+  std::atomic<std::uint64_t> write_wait_ns_;
+  std::atomic<std::uint64_t> write_waits_;
+  std::atomic<std::uint64_t> padding_bytes_;
+  std::atomic<std::uint64_t> write_wait_hist_[kStallBuckets];
+  char pad0_[kCacheLine];
+
+  // consumer side
+  std::atomic<std::uint64_t> bytes_out_;
+  std::atomic<std::uint64_t> records_out_;
+  std::atomic<std::uint64_t> read_wait_ns_;
+  std::atomic<std::uint64_t> read_waits_;
+  std::atomic<std::uint64_t> read_wait_hist_[kStallBuckets];
+  char pad1_[kCacheLine];
+
+  // either side
+  std::atomic<std::uint64_t> high_water_;
+};
+
+/*! \brief time one blocked wait, the scope of this object, into
+ *  the write or read side of `counters`
+ *  Not `blocking`: a poll that may not wait, neither timed nor
+ *  counted.
+ */
+class StallTimer {
+
+ public:
+
+#if CHANNEL_STATS
+  StallTimer(ChannelCounters& counters, bool write, bool blocking = true)
+      : counters_(counters), write_(write), blocking_(blocking),
+        start_(blocking ? ChannelCounters::Clock::now() : ChannelCounters::Clock::time_point()) {}
+
+  ~StallTimer() {
+    if(!blocking_){
+      return;
+    }
+    ChannelCounters::Clock::duration waited = ChannelCounters::Clock::now() - start_;
+    if(write_){
+      counters_.writeWaited(waited);
+    }else{
+      counters_.readWaited(waited);
+    }
+  }
+
+ private:
+
+  ChannelCounters& counters_;
+  bool write_;
+  bool blocking_;
+  ChannelCounters::Clock::time_point start_;
+#else
+  StallTimer(ChannelCounters&, bool, bool = true) {}
+#endif
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef _MEMGOVERNOR_H_
+#define _MEMGOVERNOR_H_
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <waitstrategy.hpp>
+
+
+/*! \brief process-wide byte limit shared by many Porters
+ *  Each attached member is guaranteed its `min` bytes and may grow
+ *  up to its `max` out of what is left of the limit once every
+ *  minimum is set aside, so the budget an idle member doesn't use
+ *  goes to the busy ones.
+ *
+ *  Members report every change of their usage. Only growth past
+ *  `min` takes from the shared bytes, with one CAS while nobody is
+ *  queued. A member that has to wait joins a FIFO queue; shared
+ *  bytes then go to the head of the queue first, so a large write
+ *  isn't starved by small ones. `admit` and `account` run inside a
+ *  waiter's predicate and never wake anyone; releases call
+ *  `wakeWaiting` outside of any wait, and a queued member also
+ *  polls every `kPollUs`.
+ *
+ *  The governor must outlive its members.
+ */
+class MemoryGovernor {
+
+ public:
+
+  // how often a queued member checks again without a wakeup
+  static const std::size_t kPollUs = 1000;
+
+  struct Member {
+    std::size_t min;
+    std::size_t max;
+    // notified when shared bytes may be free for this member
+    Waiter* waiter;
+    // set around a blocking wait, so a refused member queues up
+    bool waiting;
+    bool queued;
+  };
+
+  MemoryGovernor(const MemoryGovernor&) = delete;
+  MemoryGovernor& operator=(const MemoryGovernor&) = delete;
+
+  explicit MemoryGovernor(std::size_t limit);
+
+  ~MemoryGovernor();
+
+  /*! \brief add a member with `min` bytes set aside, growing up to
+   *  `max`. nullptr if `min` is larger than `max` or doesn't fit
+   *  next to the other minimums.
+   */
+  Member* attach(std::size_t min, std::size_t max, Waiter* waiter);
+
+  /*! \brief remove a member whose usage went back to 0 */
+  void detach(Member* member);
+
+  /*! \brief let `member` grow from `before` to `after` bytes
+   *  Takes the shared bytes it needs. False, with nothing taken,
+   *  if they are not free or queued members come first.
+   */
+  bool admit(Member* member, std::size_t before, std::size_t after);
+
+  /*! \brief `member` went from `before` to `after` bytes without
+   *  `admit`: shrinking, or undoing a refused growth
+   */
+  void account(Member* member, std::size_t before, std::size_t after);
+
+  /*! \brief wake the head of the queue after bytes were released
+   *  Not from inside a waiter's predicate.
+   */
+  void wakeWaiting();
+
+  /*! \brief mark `member` as blocked, refusals queue it from now on */
+  void beginWait(Member* member);
+
+  /*! \brief `member` stopped waiting, granted or not */
+  void endWait(Member* member);
+
+  /*! \brief true while some member waits for shared bytes */
+  bool contended() const { return queued_.load(std::memory_order_relaxed) > 0; }
+
+  std::size_t limit() const { return limit_; }
+
+  /*! \brief bytes taken beyond the members' minimums */
+  std::size_t shared() const { return shared_used_.load(std::memory_order_relaxed); }
+
+  /*! \brief sum of the members' minimums */
+  std::size_t reserved() const { return reserved_.load(std::memory_order_relaxed); }
+
+ private:
+
+  static const std::size_t kCacheLine = 64;
+
+  // bytes of `usage` beyond the member's minimum
+  static std::size_t excess(const Member* member, std::size_t usage) {
+    return usage > member->min ? usage - member->min : 0;
+  }
+
+  bool take(std::size_t bytes);
+  Waiter* head();
+  void wake(Waiter* waiter);
+
+  const std::size_t limit_;
+  std::atomic<std::size_t> reserved_;
+  char pad0_[kCacheLine];
+
+  std::atomic<std::size_t> shared_used_;
+  char pad1_[kCacheLine];
+
+  // slow path: members refused while waiting, oldest first
+  std::mutex mtx_;
+  std::deque<Member*> queue_;
+  std::atomic<std::size_t> queued_;
+  // wakeups picked under `mtx_` but not sent yet
+  std::atomic<int> waking_;
+};
+
+#endif
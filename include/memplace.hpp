@@ -0,0 +1,54 @@
+#ifndef _MEMPLACE_H_
+#define _MEMPLACE_H_
+
+#include <cstddef>
+
+
+/*! \brief page size used for a large buffer
+ *  `kNone`: regular 4KB pages.
+ *  `kTransparent`: ask the kernel for transparent 2MB pages
+ *                  with madvise(MADV_HUGEPAGE).
+ *  `kExplicit`: map from the hugetlbfs pool (MAP_HUGETLB), falls
+ *               back to `kTransparent` if no huge page is reserved.
+ */
+enum class HugePages { kNone, kTransparent, kExplicit };
+
+/*! \brief where and how the pages of a large buffer are placed */
+struct MemPlacement {
+  HugePages huge_pages = HugePages::kNone;
+  // touch every page up front, so page faults don't land on the
+  // data path (done after NUMA binding)
+  bool prefault = false;
+  // bind the pages to this NUMA node with mbind, -1 to keep the
+  // default first-touch policy
+  int numa_node = -1;
+
+  bool isDefault() const {
+    return huge_pages == HugePages::kNone && !prefault && numa_node < 0;
+  }
+};
+
+static const std::size_t kHugePageSize = 2 << 20;
+
+/*! \brief map `size` bytes of anonymous memory following `placement`
+ *  `size` is rounded up to the page size it is mapped with and has
+ *  to be passed to `placeFree` as is.
+ *  Return nullptr on failure.
+ */
+void* placeAlloc(std::size_t& size, const MemPlacement& placement);
+
+void placeFree(void* ptr, std::size_t size);
+
+/*! \brief apply huge pages / NUMA binding / prefault to memory that
+ *  is already mapped, e.g. a memfd or shared memory mapping.
+ *  `HugePages::kExplicit` can only be chosen at mapping time and is
+ *  treated as `kTransparent` here.
+ */
+void placeApply(void* ptr, std::size_t size, const MemPlacement& placement);
+
+/*! \brief NUMA node of the cpu the calling thread runs on
+ *  Call it from the consumer thread to bind a buffer close to it.
+ */
+int currentNumaNode();
+
+#endif
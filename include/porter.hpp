@@ -2,14 +2,33 @@
 #ifndef _PORTER_H_
 #define _PORTER_H_
 
+#include <algorithm>
+#include <cassert>
 #include <memory>
 #include <cstring>
+#include <deque>
+#include <cstdint>
+#include <chrono>
 #include <iostream>
+#include <sys/uio.h>
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <new>
+#include <vector>
+#include <channelstats.hpp>
 #include <safequeue.hpp>
+#include <spscqueue.hpp>
+#include <slabpool.hpp>
+#include <memgovernor.hpp>
+#include <memplace.hpp>
+#include <waitstrategy.hpp>
 
 
 /*! \brief Porter for transfering data between two threads
- *  Only support 1 consumer and 1 producer
+ *  Support 1 producer and 1 consumer, or a pool of consumers
+ *  sharing the work when created with `PorterOptions::consumers`
  *  3 operations:
  *    `write`: for producer putting data into buffer
  *    `read`: for consumer getting data from buffer (withou copy)
@@ -19,14 +38,100 @@
  *          should be equal. You can first call multiple `read` then
  *          call multiple consume. But be aware continues `read` may
  *          cause a dead lock because the buffer is full (not consumed)
+ *          `consumeBuffer` takes the buffers back in any order.
+ *
+ *  With several consumers every buffer goes to one of them. The
+ *  producer deals buffers round robin into one queue per consumer;
+ *  a consumer takes from its own queue and only steals from the
+ *  others when it runs dry, so consumers don't share a lock. Each
+ *  one is identified by its index and holds its own read buffers,
+ *  the overloads without `consumer` use consumer 0. A single
+ *  consumer gets the buffers through a lock-free queue instead,
+ *  unless the producer drops buffers from it in overwrite mode.
+ *
+ *  Created with `PorterOptions::lanes` it carries buffers in
+ *  priority lanes: reads serve the highest lane with buffers first,
+ *  and a lane's reserved bytes stay free for it whatever the lower
+ *  lanes hold. The overloads without `lane` write to lane 0.
  */
 
+// frees a buffer handed over to a Porter, `context` as given
+typedef void (*BufferDeleter)(void* buffer, void* context);
+
 typedef struct Item{
   void* buffer;
   std::size_t size;
-  Item(void* buffer_, std::size_t size_): buffer(buffer_), size(size_) {}
+  // given by the producer in write order, a jump means buffers
+  // were dropped in overwrite mode
+  std::uint64_t seq;
+  // how `consume` frees a buffer written with ownership transfer or
+  // loaded from the spill file, nullptr for the Porter's own copies
+  BufferDeleter deleter;
+  void* context;
+  // priority lane it was written to
+  std::size_t lane;
+  Item(): buffer(nullptr), size(0), seq(0), deleter(nullptr), context(nullptr), lane(0) {}
+  Item(void* buffer_, std::size_t size_)
+      : buffer(buffer_), size(size_), seq(0), deleter(nullptr), context(nullptr), lane(0) {}
 }Item;
 
+struct PorterOptions {
+  // huge pages / prefault / NUMA node of buffers of at least
+  // `SlabPool::kPlacedMinSize` bytes
+  MemPlacement placement;
+  // how the producer waits for budget and the consumer for buffers
+  WaitStrategy wait = WaitStrategy::kBlocking;
+  // create `readFd` / `writeFd` for event loops
+  bool event_fds = false;
+  // lossy mode: `write` never waits for budget, the oldest unread
+  // buffers are dropped instead (the new one if the consumer holds
+  // the whole budget)
+  bool overwrite = false;
+  // number of consumer threads sharing the buffers. More than 1
+  // excludes `overwrite`, `event_fds` and `spill_path`
+  std::size_t consumers = 1;
+  // non-empty: a copying `write` that finds the budget used up
+  // appends the buffer to a file created at this path instead of
+  // waiting. The file is unlinked right away, the consumer reads it
+  // back in order through large read-only mappings. Not with
+  // `overwrite`
+  std::string spill_path;
+  // most bytes held in the spill file, a write waits for budget
+  // again beyond that
+  std::size_t spill_limit = SIZE_MAX;
+  // non-null: also count the footprint against this process-wide
+  // limit, with `governor_min` bytes guaranteed and at most
+  // `governor_max`. `resize` still caps the Porter on its own
+  MemoryGovernor* governor = nullptr;
+  std::size_t governor_min = 0;
+  std::size_t governor_max = SIZE_MAX;
+  // non-zero: the Porter sizes its own budget between these bounds,
+  // starting at the lower one. It doubles while the producer stalls
+  // or spills and halves while the buffers waiting for the consumer
+  // stay far below it, freeing the cached blocks
+  std::size_t auto_size_min = 0;
+  std::size_t auto_size_max = 0;
+  // priority lanes, the highest served first. Lane l yields one
+  // buffer to a waiting lower lane after `lane_weights[l]` in a row
+  // (0: never) and keeps `lane_reserve[l]` bytes of the budget out
+  // of the other lanes' reach. Both empty or one entry per lane.
+  // More than 1 excludes `overwrite`
+  std::size_t lanes = 1;
+  std::vector<std::size_t> lane_weights;
+  std::vector<std::size_t> lane_reserve;
+};
+
+/*! \brief decisions of a Porter sizing its own budget */
+struct AutoSizeStats {
+  // budget now, and the memory it takes with cached blocks
+  std::size_t budget;
+  std::size_t footprint;
+  std::uint64_t grows;
+  std::uint64_t shrinks;
+  // cached block bytes freed by shrinks
+  std::uint64_t released_bytes;
+};
+
 class Porter{
 
  public:
@@ -34,10 +139,18 @@ class Porter{
   Porter(const Porter&) = delete;
   Porter& operator=(const Porter&) = delete;
 
-  Porter(): max_size_(0)
-          , current_size_(0)
-          , last_read_(nullptr)
-          , last_size_(0) {}
+  Porter(): Porter(PorterOptions()) {}
+
+  explicit Porter(const PorterOptions& options);
+
+  /*! \brief place buffers of at least `SlabPool::kPlacedMinSize`
+   *  bytes with `placement` (huge pages, prefault, NUMA node of the
+   *  consumer) instead of plain malloc
+   */
+  explicit Porter(const MemPlacement& placement)
+      : Porter(PorterOptions()) {
+    pool_.setPlacement(placement);
+  }
 
   ~Porter();
 
@@ -45,13 +158,86 @@ class Porter{
    */
   void write(const void* buffer, std::size_t size);
 
+  /*! \brief gather `count` fragments into a single buffer
+   *  Same as `write` with the fragments concatenated, copied
+   *  straight into the allocated buffer.
+   */
+  void writev(const struct iovec* iov, std::size_t count);
+
+  void write(std::size_t lane, const void* buffer, std::size_t size);
+  void writev(std::size_t lane, const struct iovec* iov, std::size_t count);
+
+  /*! \brief hand `buffer` over without a copy
+   *  The consumer reads `buffer` itself, `consume` frees it with
+   *  `delete[]`. Its `size` counts against the budget like a copy.
+   */
+  void write(std::unique_ptr<char[]> buffer, std::size_t size);
+
+  /*! \brief hand `buffer` over, freed by the deleter of `buffer`
+   *  A stateless deleter is created again to free it; one with state
+   *  is moved into a small block the Porter recycles, so neither
+   *  allocates per buffer once warmed up.
+   */
+  template <typename Deleter>
+  void write(std::unique_ptr<char[], Deleter> buffer, std::size_t size) {
+    adopt(std::move(buffer), size,
+          std::integral_constant<bool, std::is_empty<Deleter>::value &&
+                                       std::is_default_constructible<Deleter>::value>());
+  }
+
+  /*! \brief hand `buffer` over, `consume` calls
+   *  `deleter(buffer, context)`
+   *  Also called right away if the buffer is dropped in overwrite
+   *  mode.
+   */
+  void write(void* buffer, std::size_t size, BufferDeleter deleter,
+             void* context = nullptr);
+
+  /*! \brief `write` that never blocks
+   *  Return false if the memory budget is used up right now.
+   */
+  bool try_write(const void* buffer, std::size_t size);
+
+  /*! \brief `write` that gives up after `timeout` */
+  bool write_for(const void* buffer, std::size_t size,
+                 std::chrono::milliseconds timeout);
+
+  bool try_write(std::size_t lane, const void* buffer, std::size_t size);
+  bool write_for(std::size_t lane, const void* buffer, std::size_t size,
+                 std::chrono::milliseconds timeout);
+
   /*! \brief read a buffer from RingBuffer
    *  Get a buffer ptr and it's size withou copy
    */
   void read(void** buffer, std::size_t& size);
 
+  /*! \brief read every available buffer in one call
+   *  Block until at least one buffer is ready, then fill `items`
+   *  with up to `max_items` buffers whose total size doesn't exceed
+   *  `max_bytes` (the first buffer is always returned).
+   *  Return the number of buffers filled.
+   */
+  std::size_t readBatch(Item* items, std::size_t max_items,
+                        std::size_t max_bytes = SIZE_MAX);
+
+  /*! \brief `read` that never blocks
+   *  Return false if no buffer is ready right now.
+   */
+  bool try_read(void** buffer, std::size_t& size);
+
+  /*! \brief `read` that gives up after `timeout` */
+  bool read_for(void** buffer, std::size_t& size, std::chrono::milliseconds timeout);
+
   void lastRead(void** buffer, std::size_t& size);
 
+  void read(std::size_t consumer, void** buffer, std::size_t& size);
+  std::size_t readBatch(std::size_t consumer, Item* items, std::size_t max_items,
+                        std::size_t max_bytes = SIZE_MAX);
+  bool try_read(std::size_t consumer, void** buffer, std::size_t& size);
+  bool read_for(std::size_t consumer, void** buffer, std::size_t& size,
+                std::chrono::milliseconds timeout);
+  void lastRead(std::size_t consumer, void** buffer, std::size_t& size);
+
   /*! \brief notification a buffer has been consumed
    *  Indicate that the content of read buffer is useless
    *  so this buffer's content can be covered.
@@ -60,24 +246,227 @@ class Porter{
    */
   void consume();
 
+  /*! \brief consume the next `n` read buffers at once
+   *  Same as calling `consume` n times, but update the memory
+   *  budget with a single lock and wakeup.
+   */
+  void consumeN(std::size_t n);
+
+  void consume(std::size_t consumer);
+  void consumeN(std::size_t consumer, std::size_t n);
+
+  /*! \brief consume the read buffer `buffer`, in any order
+   *  `buffer` is the pointer `read` / `readBatch` returned; it goes
+   *  back to the budget right away, whatever is still held before
+   *  it. `consume` / `consumeN` move on to the oldest buffer left.
+   */
+  void consumeBuffer(const void* buffer);
+  void consumeBuffer(std::size_t consumer, const void* buffer);
+
+  std::size_t consumers() const { return num_consumers_; }
+
+  std::size_t lanes() const { return num_lanes_; }
+
   /*! \breif dynamically change the max allocate size
    *  may fail due to current allocation memory is
-   *  larger than the required resized number
+   *  larger than the required resized number.
+   *  Buffers are charged by their pool block size, and blocks
+   *  cached for reuse count until the producer trims them.
+   *  With auto sizing the next decision overrides it.
    */
   bool resize(std::size_t size);
 
+  /*! \brief eventfds of a Porter created with `PorterOptions::event_fds`
+   *  `readFd` turns readable once a buffer may be ready after a
+   *  `try_read` / `read_for` gave up, `writeFd` once budget may be
+   *  free after a `try_write` / `write_for` gave up. Poll them for
+   *  input, then just retry. -1 if not enabled.
+   */
+  int readFd() const { return log_ ? log_->eventFd() : logs_[0]->eventFd(); }
+  int writeFd() const { return not_full_.eventFd(); }
+
+  /*! \brief counters of the Porter, callable from any thread
+   *  Occupancy is the memory budget in use.
+   */
+  ChannelStats stats() const;
+
+  /*! \brief buffers lost in overwrite mode so far */
+  std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  /*! \brief budget decisions of a Porter created with
+   *  `PorterOptions::auto_size_max`, callable from any thread
+   */
+  AutoSizeStats autoSizeStats() const;
+
+  /*! \brief buffers written to the spill file so far */
+  std::uint64_t spilled() const { return spilled_.load(std::memory_order_relaxed); }
+
  protected:
-  
-  std::size_t max_size_;
-  std::size_t current_size_;
-  void* last_read_;
-  std::size_t last_size_;
 
-  std::mutex size_mtx_;
-  std::condition_variable not_full_;
+  static const std::size_t kCacheLine = 64;
+  // how long a waiting consumer sleeps on its own queue before it
+  // looks for buffers to steal again
+  static const std::size_t kStealIntervalUs = 1000;
+  // the consumer maps the spill file this much at a time
+  static const std::size_t kSpillWindow = 32 << 20;
+  // every buffer in the spill file starts at a multiple of this
+  static const std::size_t kSpillAlign = 64;
+  // auto sizing: one decision per interval. Grow once the producer
+  // waited 1/kAutoGrowStall of it, shrink after kAutoShrinkIntervals
+  // in a row with less than 1/kAutoShrinkUse of the budget pending
+  static const std::size_t kAutoSizeIntervalMs = 10;
+  static const std::size_t kAutoGrowStall = 20;
+  static const std::size_t kAutoShrinkUse = 4;
+  static const std::size_t kAutoShrinkIntervals = 10;
+  // producer writes between two looks at the clock
+  static const std::size_t kAutoSizeCheck = 64;
+
+  // buffers a consumer read but didn't consume yet, on its own
+  // cache lines
+  struct Consumer {
+    std::deque<Item> wait_consume;
+    void* last_read;
+    std::size_t last_size;
+    char pad[kCacheLine];
+    Consumer(): last_read(nullptr), last_size(0) {}
+  };
+
+  // part of the spill file mapped by the consumer, unmapped once it
+  // was moved past and the last buffer in it is consumed. Holds a
+  // single buffer read with `pread` if the mapping failed
+  struct SpillWindow {
+    Porter* owner;
+    char* base;
+    std::uint64_t start;
+    std::size_t length;
+    std::size_t refs;
+    bool current;
+    bool mapped;
+  };
+
+  // a stateful deleter of an adopted buffer, in a block of
+  // `deleter_pool_`
+  template <typename Deleter>
+  struct HeldDeleter {
+    SlabPool* pool;
+    Deleter deleter;
+  };
+
+  template <typename Deleter>
+  void adopt(std::unique_ptr<char[], Deleter> buffer, std::size_t size, std::true_type) {
+    write(buffer.release(), size, [](void* ptr, void*) {
+      Deleter()(static_cast<char*>(ptr));
+    });
+  }
+
+  template <typename Deleter>
+  void adopt(std::unique_ptr<char[], Deleter> buffer, std::size_t size, std::false_type) {
+    typedef HeldDeleter<Deleter> Held;
+    void* block = deleter_pool_.take(sizeof(Held));
+    if(block == nullptr){
+      block = deleter_pool_.allocate(sizeof(Held));
+      if(block == nullptr){
+        throw std::bad_alloc();
+      }
+    }
+    Held* held = new (block) Held{&deleter_pool_, std::move(buffer.get_deleter())};
+    write(buffer.release(), size, [](void* ptr, void* context) {
+      Held* held = static_cast<Held*>(context);
+      SlabPool* pool = held->pool;
+      held->deleter(static_cast<char*>(ptr));
+      held->~Held();
+      pool->give(held, sizeof(Held));
+    }, held);
+  }
+
+  static void deleteArray(void* buffer, void* context);
+  // deleter of a buffer queued in the spill file, `context` is its
+  // file offset, and of one loaded from it, `context` is its window
+  static void unspilled(void* buffer, void* context);
+  static void unmapSpilled(void* buffer, void* context);
+  static bool isSpilled(const Item& item);
+  static void dropWindow(SpillWindow* window);
+
+  bool obtain(std::size_t size, void** buffer, std::size_t lane);
+  bool acquire(std::size_t size, void** buffer, std::size_t lane,
+               Waiter::Clock::time_point deadline);
+  bool waitBudget(std::size_t size, void** buffer, std::size_t lane,
+                  Waiter::Clock::time_point deadline);
+  std::size_t laneLimit(std::size_t lane) const;
+  void autoSize();
+  void publish(Item& item);
+  std::size_t take(std::size_t consumer, Item* items, std::size_t max_items,
+                   std::size_t max_bytes, Waiter::Clock::time_point deadline);
+  void popped(std::size_t consumer, const Item* items, std::size_t count);
+  void release(const Item& item);
+  bool charge(std::size_t size, std::size_t limit);
+  void uncharge(std::size_t size);
+  bool writeUntil(std::size_t lane, const struct iovec* iov, std::size_t count,
+                  Waiter::Clock::time_point deadline);
+  bool spill(std::size_t lane, const struct iovec* iov, std::size_t count, std::size_t size);
+  void loadSpilled(Item& item);
+  SpillWindow* mapWindow(std::uint64_t ofs, std::size_t size);
+
+  // buffers come from here, in block sizes
+  SlabPool pool_;
+  // blocks holding the deleters of adopted buffers, not charged
+  SlabPool deleter_pool_;
+  bool overwrite_;
+  // producer side: sequence number of the next buffer
+  std::uint64_t next_seq_;
+  std::atomic<std::uint64_t> dropped_;
+
+  std::atomic<std::size_t> max_size_;
+  // memory footprint: blocks in use plus the ones cached in `pool_`
+  std::atomic<std::size_t> current_size_;
+
+  Waiter not_full_;
+
+  // one queue per consumer, filled round robin by the producer. A
+  // single consumer without overwrite uses the lock-free `log_`
+  std::size_t num_consumers_;
+  std::size_t next_queue_;
+  std::vector<std::unique_ptr<SafeQueue<Item>>> logs_;
+  std::unique_ptr<SpscQueue<Item>> log_;
+  std::unique_ptr<Consumer[]> consumers_;
+
+  // priority lanes: bytes each one holds, charged by the producer
+  // and released by the consumers, and the bytes kept for it
+  std::size_t num_lanes_;
+  std::vector<std::size_t> lane_reserve_;
+  std::unique_ptr<std::atomic<std::size_t>[]> lane_used_;
+
+  // spill file, -1 if not enabled. The producer appends at
+  // `spill_end_` and starts over once every spilled buffer has been
+  // consumed
+  int spill_fd_;
+  std::size_t spill_limit_;
+  std::uint64_t spill_end_;
+  std::uint64_t spill_records_;
+  std::atomic<std::uint64_t> spill_released_;
+  std::atomic<std::uint64_t> spilled_;
+  // consumer side: window of the last buffer loaded
+  SpillWindow* spill_window_;
+
+  MemoryGovernor* governor_;
+  MemoryGovernor::Member* member_;
+
+  // auto sizing, 0 `auto_max_` if off. Buffers charged and not
+  // consumed yet; the rest is producer private but the results
+  std::size_t auto_min_;
+  std::size_t auto_max_;
+  std::atomic<std::size_t> pending_;
+  Waiter::Clock::time_point auto_since_;
+  Waiter::Clock::duration auto_stalled_;
+  std::size_t auto_writes_;
+  std::size_t auto_peak_;
+  std::size_t auto_spills_;
+  std::size_t auto_light_;
+  std::atomic<std::uint64_t> grows_;
+  std::atomic<std::uint64_t> shrinks_;
+  std::atomic<std::uint64_t> released_;
 
-  SafeQueue<Item> logs_;
-  std::queue<Item> wait_consume_;
+  ChannelCounters counters_;
 };
 
 #endif
\ No newline at end of file
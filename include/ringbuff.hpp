@@ -3,19 +3,77 @@
 
 #include <iostream>
 #include <cstdlib>
+#include <cstdint>
 #include <memory>
 #include <thread>
 #include <stdexcept>
+#include <atomic>
+#include <mutex>
 #include <condition_variable>
-#include <queue>
 #include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
 #include <assert.h>
+#include <sys/uio.h>
 
-#include <safequeue.hpp>
+#include <channelstats.hpp>
+#include <memplace.hpp>
+#include <waitstrategy.hpp>
 
+/*! \brief where RingBuffer places `buffer_`
+ *  `kMalloc`: plain heap allocation. A record that doesn't fit
+ *             before the end is moved to the head behind padding.
+ *  `kMirrored`: the same memfd pages mapped twice back to back,
+ *               so every record is continous and no padding is
+ *               needed. Size is rounded up to the page size.
+ *               Falls back to `kMalloc` if the mapping fails.
+ */
+enum class RingBackend { kMalloc, kMirrored };
+
+struct RingOptions {
+  RingBackend backend = RingBackend::kMalloc;
+  // allow several threads to `write` / `reserve` at the same time
+  bool multi_producer = false;
+  // number of broadcast readers, each of them sees every record.
+  // More than 1 reader requires a single producer
+  std::size_t readers = 1;
+  // huge pages / prefault / NUMA node of the record buffer
+  MemPlacement placement;
+  // non-empty: create or attach the POSIX shared memory segment
+  // of this name (e.g. "/my_ring") so processes can share the ring.
+  // An existing segment keeps the size / backend / producer and
+  // reader settings it was created with.
+  std::string shm_name;
+  // how a producer waits for space and a reader for records
+  WaitStrategy wait = WaitStrategy::kSpinFutex;
+  // create `readFd` / `writeFd` for event loops. Not for shared
+  // or broadcast rings
+  bool event_fds = false;
+  // lossy mode: a producer never waits for space, the oldest unread
+  // records are dropped instead. Each record carries a sequence
+  // number so the reader can see gaps. Single producer and reader,
+  // not for shared rings
+  bool overwrite = false;
+  // every payload handed out starts at a multiple of this: a power
+  // of two from 8 up to the page size, e.g. 64 for cache lines or
+  // `sysconf(_SC_PAGESIZE)`. Each record then takes a multiple of
+  // it, so large values suit large records
+  std::size_t align = 8;
+};
 
-/*! \brief RingBuffer for transfering data between two threads
- *  Only support 1 consumer and 1 producer
+/*! \brief a record handed out by `RingBuffer::readBatch` */
+struct RingRecord {
+  void* buffer;
+  std::size_t size;
+  // overwrite mode: sequence number given by the producer, a jump
+  // means records were dropped. 0 otherwise
+  std::uint64_t seq;
+};
+
+/*! \brief RingBuffer for transfering data between threads
+ *  Support 1 consumer and 1 producer, or 1 consumer and many
+ *  producers when created with `RingOptions::multi_producer`
  *  3 operations:
  *    `write`: for producer putting data into buffer
  *    `read`: for consumer getting data from buffer (withou copy)
@@ -25,6 +83,40 @@
  *          should be equal. You can first call multiple `read` then
  *          call multiple consume. But be aware continues `read` may
  *          cause a dead lock because the buffer is full (not consumed)
+ *          `consumeBuffer` takes the buffers back in any order.
+ *
+ *  Each record is stored in `buffer_` as an 8-byte header holding its
+ *  size followed by the payload, so no side queue is needed to find
+ *  record boundaries. Producer and consumer only share two atomic
+ *  cursors (kept on separate cache lines) and never take a lock
+ *  unless one side has to sleep on a full or empty buffer.
+ *  With `RingOptions::align` above 8 the header sits at the end of
+ *  the first `align` bytes of a record and records are rounded up to
+ *  `align`, so every cursor and every payload stays aligned; the
+ *  padding counts against the capacity like the payload does.
+ *
+ *  With `RingOptions::readers` > 1 every record is delivered to each
+ *  reader. Readers are identified by their index and keep their own
+ *  read/consume cursors; space is released once the slowest reader
+ *  has consumed it. The overloads without `reader` use reader 0.
+ *
+ *  A ring created with `RingOptions::shm_name` keeps all of its state
+ *  (cursors, commit bits, records) in the shared memory segment and
+ *  sleeps on futexes in it, so producers and consumers can live in
+ *  different processes. A restarted process just attaches again;
+ *  records a reader had read but not consumed are delivered again.
+ *
+ *  With `RingOptions::overwrite` the reader claims records by moving
+ *  a shared read cursor with CAS, and a producer short of space
+ *  moves the same cursor past the oldest unread record to drop it.
+ *  Records read but not consumed are never dropped; while they
+ *  block the space, the new record is dropped instead. Both kinds
+ *  of loss count in `dropped`.
+ *
+ *  In multi-producer mode `ofs_writer` is a claim cursor advanced
+ *  with CAS. A producer publishes its record by setting the bit of
+ *  its header slot in `commit_bits_`; the consumer walks headers in
+ *  claim order and stops at the first slot whose bit is not set.
  */
 class RingBuffer{
 
@@ -33,18 +125,100 @@ class RingBuffer{
   RingBuffer(const RingBuffer&) = delete;
   RingBuffer& operator=(const RingBuffer&) = delete;
 
-  explicit RingBuffer(std::size_t buffer_size);
+  explicit RingBuffer(std::size_t buffer_size,
+                      const RingOptions& options = RingOptions());
 
   /*! \brief write a buffer into RingBuffer
-   *  Thread safe
+   *  Only the producer thread can call this, unless the ring is
+   *  multi-producer
    */
   void write(const void* buffer, std::size_t size);
 
+  /*! \brief gather `count` fragments into a single record
+   *  Same as `write` with the fragments concatenated, without
+   *  building the concatenation first.
+   */
+  void writev(const struct iovec* iov, std::size_t count);
+
+  /*! \brief `readv` up to `max` bytes from `fd` straight into the ring
+   *  Block until there is space for at least one byte, then publish
+   *  what the fd returned as one record, or as two when the free
+   *  space wraps around the end of the buffer.
+   *  Return the `readv` result: bytes read, 0 at end of file, -1
+   *  with `errno` set on error. Single producer, not in overwrite mode.
+   */
+  ssize_t fillFromFd(int fd, std::size_t max = SIZE_MAX);
+
+  /*! \brief `write` that never blocks
+   *  Return false if there is no space for the record right now.
+   */
+  bool try_write(const void* buffer, std::size_t size);
+
+  /*! \brief `write` that gives up after `timeout` */
+  bool write_for(const void* buffer, std::size_t size,
+                 std::chrono::milliseconds timeout);
+
+  /*! \brief reserve space for a record of at most `size` bytes
+   *  Return a writable ptr inside the ring (nullptr if `size` can
+   *  never fit), so the producer can build the record in place.
+   *  Block like `write` until enough space has been consumed.
+   *  In overwrite mode nullptr means the record had to be dropped.
+   */
+  void* reserve(std::size_t size);
+
+  /*! \brief publish the record prepared after `reserve`
+   *  `size` is the real record size and should not be larger
+   *  than the reserved size.
+   *  Single-producer only: use `commit(slot, size)` when several
+   *  reservations may be pending.
+   */
+  void commit(std::size_t size);
+
+  /*! \brief publish the record reserved at `slot`
+   *  Producers of a multi-producer ring may commit in any order,
+   *  the consumer still reads records in reservation order.
+   */
+  void commit(void* slot, std::size_t size);
+
   /*! \brief read a buffer from RingBuffer
    *  Get a buffer ptr and it's size withou copy
    */
   void read(void** buffer, std::size_t& size);
 
+  /*! \brief read every available record in one call
+   *  Block until at least one record is ready, then fill `records`
+   *  with up to `max_records` records whose total size doesn't
+   *  exceed `max_bytes` (the first record is always returned).
+   *  Return the number of records filled. Each of them still needs
+   *  to be consumed, e.g. with one `consumeN` call.
+   */
+  std::size_t readBatch(RingRecord* records, std::size_t max_records,
+                        std::size_t max_bytes = SIZE_MAX);
+
+  void read(std::size_t reader, void** buffer, std::size_t& size);
+  std::size_t readBatch(std::size_t reader, RingRecord* records,
+                        std::size_t max_records, std::size_t max_bytes = SIZE_MAX);
+
+  /*! \brief `writev` the payloads of ready records to `fd`
+   *  Block until a record is ready, write as many as one call takes
+   *  and consume the ones written completely. The rest of a record
+   *  cut short is written first next time. Return the `writev`
+   *  result. Don't mix with `read` on the same reader.
+   */
+  ssize_t drainToFd(int fd);
+  ssize_t drainToFd(std::size_t reader, int fd);
+
+  /*! \brief `read` that never blocks
+   *  Return false if no record is ready right now.
+   */
+  bool try_read(void** buffer, std::size_t& size);
+  bool try_read(std::size_t reader, void** buffer, std::size_t& size);
+
+  /*! \brief `read` that gives up after `timeout` */
+  bool read_for(void** buffer, std::size_t& size, std::chrono::milliseconds timeout);
+  bool read_for(std::size_t reader, void** buffer, std::size_t& size,
+                std::chrono::milliseconds timeout);
+
   /*! \brief notification a buffer has been consumed
    *  Indicate that the content of read buffer is useless
    *  so this buffer's content can be covered.
@@ -53,27 +227,210 @@ class RingBuffer{
    */
   void consume();
 
+  /*! \brief consume the next `n` read records at once
+   *  Same as calling `consume` n times, but release the space
+   *  with a single cursor update and wakeup.
+   */
+  void consumeN(std::size_t n);
+
+  void consume(std::size_t reader);
+  void consumeN(std::size_t reader, std::size_t n);
+
+  /*! \brief consume the read record at `buffer`, in any order
+   *  `buffer` is the pointer `read` / `readBatch` returned. Space is
+   *  released up to the oldest record still held, so a slow record
+   *  only holds back itself and the space behind it. `consume` /
+   *  `consumeN` skip records consumed this way.
+   */
+  void consumeBuffer(const void* buffer);
+  void consumeBuffer(std::size_t reader, const void* buffer);
+
+  std::size_t readers() const { return num_readers_; }
+
+  /*! \brief boundary every payload starts at */
+  std::size_t align() const { return align_; }
+
+  /*! \brief records lost in overwrite mode so far */
+  std::uint64_t dropped() const {
+    return ctl_->dropped.load(std::memory_order_relaxed);
+  }
+
+  /*! \brief counters of this process' side of the ring
+   *  Occupancy is sampled whenever one side reloads the other's
+   *  cursor. Callable from any thread.
+   */
+  ChannelStats stats() const;
+
+  /*! \brief eventfds for a ring created with `RingOptions::event_fds`
+   *  `readFd` turns readable once a record may be ready after a
+   *  `try_read` / `read_for` gave up, `writeFd` once space may be
+   *  free after a `try_write` / `write_for` gave up. Poll them for
+   *  input, then just retry; the ring drains them itself.
+   *  -1 if not enabled.
+   */
+  int readFd() const { return not_empty_.eventFd(); }
+  int writeFd() const { return not_full_.eventFd(); }
+
+  /*! \brief remove a shared memory segment created by a ring
+   *  Rings already attached to it keep working.
+   */
+  static bool unlink(const std::string& shm_name);
+
   ~RingBuffer();
 
  protected:
 
-  std::size_t buffer_size_;
+  typedef std::uint64_t Header;
+
+  static const std::size_t kCacheLine = 64;
+  static const std::size_t kRecordAlign = sizeof(Header);
+  // most records a single `drainToFd` hands to `writev`
+  static const std::size_t kDrainRecords = 64;
+  // header flag for the filler record written in front of a wrap
+  static const Header kPaddingFlag = 1ULL << 63;
+  // marks an initialized shared memory segment
+  static const std::uint64_t kShmMagic = 0x52494e4742554634ULL;
+  // longest wait for the creator of a shared segment to set it up
+  static const std::size_t kShmAttachMs = 2000;
+
+  // bytes a record of `size` payload bytes occupies in the ring
+  std::size_t recordSize(std::size_t size) const {
+    return prefix_ + ((size + align_ - 1) & ~(align_ - 1));
+  }
+
+  // a record starts with `prefix_` bytes ending with its header, so
+  // the payload right behind it is aligned like the record start
+  Header* headerAt(std::size_t ofs) const {
+    return reinterpret_cast<Header*>((char*)buffer_ + ofs % buffer_size_ +
+                                     prefix_ - header_size_);
+  }
 
-  std::mutex mtx_;
-  std::condition_variable not_full_;
-  std::condition_variable not_empty_;
+  void* payloadAt(std::size_t ofs) const {
+    return (char*)buffer_ + ofs % buffer_size_ + prefix_;
+  }
 
-  std::size_t ofs_reader_;
-  std::size_t ofs_consumer_;
-  std::size_t ofs_writer_;
+  // consume cursor of one reader, on its own cache lines
+  struct Consumer {
+    std::atomic<std::size_t> ofs;
+    char pad[kCacheLine];
+  };
 
-  SafeQueue<std::size_t> wait_read_;
-  std::queue<std::size_t> wait_consume_;
+  // reader state private to this process: read cursor, start of
+  // the records read but not consumed yet, last seen writer cursor
+  // and bytes of the oldest held record already sent by `drainToFd`,
+  // plus the held records consumed out of order, all behind
+  // `ofs_held`. Not shared so that a restarted consumer starts again
+  // from its consume cursor
+  struct Reader {
+    std::atomic<std::size_t>* ofs_consumer;
+    std::size_t ofs_reader;
+    std::size_t ofs_held;
+    std::size_t cached_writer;
+    std::size_t drained;
+    std::vector<std::size_t> done;
+    char pad[kCacheLine];
+  };
 
+  // state shared by every side of the ring, followed in memory by
+  // `Consumer[readers]` and the commit bits. Lives at the head of the
+  // shared memory segment for a shared ring, on the heap otherwise
+  struct Control {
+    std::atomic<std::uint64_t> magic;
+    std::uint64_t buffer_size;
+    std::uint64_t readers;
+    std::uint64_t multi_producer;
+    std::uint64_t mirrored;
+    std::uint64_t align;
+    char pad0[kCacheLine];
+    // producer cursor
+    std::atomic<std::size_t> ofs_writer;
+    char pad1[kCacheLine];
+    // overwrite mode: read cursor shared with the dropping producer
+    std::atomic<std::size_t> ofs_read;
+    std::atomic<std::uint64_t> dropped;
+    char pad3[kCacheLine];
+    // slow path: only touched when one side sleeps
+    WaitWord not_full;
+    WaitWord not_empty;
+    char pad2[kCacheLine];
+  };
+
+  static std::size_t controlSize(std::size_t readers, std::size_t buffer_size,
+                                 bool multi_producer);
+  void initControl(void* mem);
+  void attachControl(void* mem);
+  void attachWaiters();
+  void attachReaders();
+  void releaseBuffer();
+  bool mapMirrored(int fd, std::size_t offset);
+  void openShared(const RingOptions& options);
+  void* reserveUntil(std::size_t size, Waiter::Clock::time_point deadline);
+  bool writeUntil(const void* buffer, std::size_t size,
+                  Waiter::Clock::time_point deadline);
+  bool readUntil(std::size_t reader, void** buffer, std::size_t& size,
+                 Waiter::Clock::time_point deadline);
+  std::size_t readBatchUntil(std::size_t reader, RingRecord* records,
+                             std::size_t max_records, std::size_t max_bytes,
+                             Waiter::Clock::time_point deadline);
+  std::size_t claim(std::size_t len, Waiter::Clock::time_point deadline);
+  void setCommitted(std::size_t ofs);
+  bool committed(std::size_t ofs) const;
+  void clearCommitted(std::size_t ofs);
+  bool ready(Reader& r);
+  std::size_t slowestConsumer() const;
+  bool waitSpace(std::size_t writer, std::size_t size,
+                 Waiter::Clock::time_point deadline);
+  bool makeSpace(std::size_t writer, std::size_t size);
+  bool claimRead(Reader& r, std::size_t len);
+  bool waitData(Reader& r, Waiter::Clock::time_point deadline);
+  void publishWriter(std::size_t ofs);
+  void notifyReader();
+  void publishConsumer(Reader& r, std::size_t ofs);
+  bool takeDone(Reader& r, std::size_t ofs);
+
+  std::size_t buffer_size_;
   void* buffer_;
+  bool mirrored_;
+  bool multi_producer_;
+  bool shared_;
+  bool overwrite_;
+  // size header, plus the sequence number in overwrite mode
+  std::size_t header_size_;
+  // payload alignment, and the header size rounded up to it
+  std::size_t align_;
+  std::size_t prefix_;
+  MemPlacement placement_;
+  // mapped size of a buffer from `placeAlloc`, 0 if not used
+  std::size_t placed_size_;
+  std::size_t num_readers_;
+
+  Control* ctl_;
+  Consumer* consumers_;
+  Reader* readers_;
+  // multi-producer only: one bit per `kRecordAlign` slot
+  std::atomic<std::uint64_t>* commit_bits_;
+  // bytes of the control area mapped from a shared ring's segment
+  std::size_t ctl_size_;
+
+  char pad0_[kCacheLine];
+
+  // producer private: last seen consumer cursor (unused with
+  // several producers) and the pending single-producer reservation
+  std::size_t cached_consumer_;
+  std::size_t reserved_;
+  // overwrite mode: sequence number of the next record
+  std::uint64_t next_seq_;
+
+  char pad1_[kCacheLine];
+
+  // producers wait for space, readers for records
+  Waiter not_full_;
+  Waiter not_empty_;
+
+  ChannelCounters counters_;
 
 };
 
 
 
-#endif
\ No newline at end of file
+#endif
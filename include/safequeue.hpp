@@ -3,87 +3,249 @@
 #define _SFAEQUEUE_H_
 
 #include <queue>
+#include <vector>
 #include <mutex>
-#include <condition_variable>
+#include <atomic>
 #include <chrono>
-
+#include <channelstats.hpp>
+#include <waitstrategy.hpp>
+
+/*! \brief mutex protected FIFO, optionally split in priority lanes
+ *  With several lanes every pop serves the highest non-empty lane,
+ *  FIFO within a lane. A lane with a non-zero weight passes its
+ *  turn to the next waiting lower lane after `weight` items in a
+ *  row, which passes it on if it used up its own weight, so no
+ *  lane is starved.
+ */
 template <typename T>
 class SafeQueue {
 
  public:
 
-  SafeQueue()
-    : q_()
+  explicit SafeQueue(WaitStrategy wait = WaitStrategy::kBlocking, std::size_t lanes = 1,
+                     const std::vector<std::size_t>& weights = std::vector<std::size_t>())
+    : q_(lanes)
+    , weights_(weights)
+    , served_(lanes, 0)
+    , count_(0)
     , qmtx_()
-    , empty_()
-  {}
+    , size_(0)
+    , not_empty_(wait)
+  {
+    weights_.resize(lanes, 0);
+  }
 
   ~SafeQueue() {}
 
-  void push(T&& item) {
-    std::lock_guard<std::mutex> lock(qmtx_);
-    q_.push(item);
-    empty_.notify_one();
+  void push(T&& item, std::size_t lane = 0) {
+    std::unique_lock<std::mutex> lock(qmtx_);
+    q_[lane].push(item);
+    size_.store(++count_, std::memory_order_release);
+    counters_.in(0);
+    counters_.occupancy(count_);
+    lock.unlock();
+    not_empty_.notify();
   }
 
-  void push(T& item) {
-    std::lock_guard<std::mutex> lock(qmtx_);
-    q_.push(item);
-    empty_.notify_one();
+  void push(T& item, std::size_t lane = 0) {
+    std::unique_lock<std::mutex> lock(qmtx_);
+    q_[lane].push(item);
+    size_.store(++count_, std::memory_order_release);
+    counters_.in(0);
+    counters_.occupancy(count_);
+    lock.unlock();
+    not_empty_.notify();
   }
 
   void front(T& res) {
     std::lock_guard<std::mutex> lock(qmtx_);
-    res = std::move(q_.front());
+    res = std::move(q_[pickLane()].front());
   }
 
   void pop() {
-    std::unique_lock<std::mutex> lock(qmtx_);
-    while(q_.empty()){
-      empty_.wait(lock);
-    }
-    q_.pop();
-    lock.unlock();
+    std::unique_lock<std::mutex> lock;
+    lockItem(lock);
+    popLocked(pickLane());
   }
 
   bool try_pop(std::chrono::milliseconds timeout) {
-    std::unique_lock<std::mutex> lock(qmtx_);
-    if(empty_.wait_for(lock, timeout, [this] {return !q_.empty(); })){
+    std::unique_lock<std::mutex> lock;
+    if(!lockItem(lock, Waiter::deadlineAfter(timeout))){
       return false;
     }
-    q_.pop();
+    popLocked(pickLane());
     return true;
   }
 
   void fpop(T& res){
-    std::unique_lock<std::mutex> lock(qmtx_);
-    while(q_.empty()){
-      empty_.wait(lock);
+    std::unique_lock<std::mutex> lock;
+    lockItem(lock);
+    std::size_t lane = pickLane();
+    res = std::move(q_[lane].front());
+    popLocked(lane);
+  }
+
+  /*! \brief pop several items under one lock
+   *  Block until the queue is not empty, then move up to `max`
+   *  items into `res` while `accept(next_item)` holds.
+   *  `accept` sees every candidate, but the first item is
+   *  always taken.
+   */
+  template <typename Accept>
+  std::size_t fpop_n(T* res, std::size_t max, Accept accept){
+    return fpop_n(res, max, accept, Waiter::forever());
+  }
+
+  /*! \brief `fpop_n` that gives up at `deadline`, returning 0 */
+  template <typename Accept>
+  std::size_t fpop_n(T* res, std::size_t max, Accept accept,
+                     Waiter::Clock::time_point deadline){
+    std::unique_lock<std::mutex> lock;
+    if(max == 0 || !lockItem(lock, deadline)){
+      return 0;
     }
-    res = std::move(q_.front());
-    q_.pop();
-    lock.unlock();
+    std::size_t count = 0;
+    while(count < max && count_ > 0){
+      std::size_t lane = pickLane();
+      bool ok = accept(q_[lane].front());
+      if(count > 0 && !ok){
+        break;
+      }
+      res[count++] = std::move(q_[lane].front());
+      q_[lane].pop();
+      --count_;
+      served(lane);
+    }
+    size_.store(count_, std::memory_order_release);
+    counters_.out(0, count);
+    return count;
+  }
+
+  /*! \brief pop the front item if there is one
+   *  Never waits and never arms the eventfd.
+   */
+  bool try_fpop(T& res) {
+    std::lock_guard<std::mutex> lock(qmtx_);
+    if(count_ == 0){
+      return false;
+    }
+    std::size_t lane = pickLane();
+    res = std::move(q_[lane].front());
+    popLocked(lane);
+    return true;
   }
 
   bool try_fpop(T& res, std::chrono::milliseconds timeout) {
-    std::unique_lock<std::mutex> lock(qmtx_);
-    if(empty_.wait_for(lock, timeout, [this] {return !q_.empty(); })){
+    std::unique_lock<std::mutex> lock;
+    if(!lockItem(lock, Waiter::deadlineAfter(timeout))){
       return false;
     }
-    res = std::move(q_.front());
-    q_.pop();
+    std::size_t lane = pickLane();
+    res = std::move(q_[lane].front());
+    popLocked(lane);
     return true;
   }
 
+  /*! \brief eventfd that turns readable once an item may be
+   *  available after a `try_pop` / `try_fpop` gave up, -1 on failure
+   */
+  int enableEvent() { return not_empty_.enableEvent(); }
+
+  int eventFd() const { return not_empty_.eventFd(); }
+
   bool empty() {
     std::lock_guard<std::mutex> lock(qmtx_);
-    return q_.empty();
+    return count_ == 0;
+  }
+
+  /*! \brief counters of the queue, in items, from any thread */
+  ChannelStats stats() const {
+    ChannelStats s = counters_.snapshot();
+    s.wakeups = not_empty_.wakeups();
+    return s;
   }
 
  private:
-  std::queue<T> q_;
+
+  bool hasItem() const {
+    return size_.load(std::memory_order_acquire) != 0;
+  }
+
+  // wait with the queue's strategy until the queue is not empty,
+  // then lock `qmtx_`. False if `deadline` passed first
+  bool lockItem(std::unique_lock<std::mutex>& lock,
+                Waiter::Clock::time_point deadline = Waiter::forever()) {
+    while(true){
+      if(!hasItem()){
+        StallTimer stall(counters_, false, deadline != Waiter::noWait());
+        if(!not_empty_.waitUntil([this] { return hasItem(); }, deadline)){
+          return false;
+        }
+      }
+      lock = std::unique_lock<std::mutex>(qmtx_);
+      if(count_ > 0){
+        return true;
+      }
+      lock.unlock();
+    }
+  }
+
+  // under `qmtx_`, not empty: the highest non-empty lane, unless
+  // it used up its weight and passes the turn down to the next
+  // waiting one, which may pass it on in turn
+  std::size_t pickLane() const {
+    std::size_t lane = q_.size() - 1;
+    if(lane == 0){
+      return 0;
+    }
+    while(q_[lane].empty()){
+      --lane;
+    }
+    for(std::size_t lower = lane; lower-- > 0;){
+      if(!q_[lower].empty()){
+        if(weights_[lane] == 0 || served_[lane] < weights_[lane]){
+          return lane;
+        }
+        lane = lower;
+      }
+    }
+    return lane;
+  }
+
+  // an item of `lane` was popped: it counts against the weight
+  // while a lower lane waits, the lanes above that passed their
+  // turn to it start over
+  void served(std::size_t lane) {
+    if(q_.size() == 1){
+      return;
+    }
+    bool waiting = false;
+    for(std::size_t lower = 0; lower < lane && !waiting; ++lower){
+      waiting = !q_[lower].empty();
+    }
+    served_[lane] = waiting ? served_[lane] + 1 : 0;
+    for(std::size_t upper = lane + 1; upper < q_.size(); ++upper){
+      served_[upper] = 0;
+    }
+  }
+
+  void popLocked(std::size_t lane) {
+    q_[lane].pop();
+    served(lane);
+    size_.store(--count_, std::memory_order_release);
+    counters_.out(0);
+  }
+
+  std::vector<std::queue<T>> q_;
+  std::vector<std::size_t> weights_;
+  // items served in a row from each lane
+  std::vector<std::size_t> served_;
+  std::size_t count_;
   mutable std::mutex qmtx_;
-  std::condition_variable empty_;
+  // item count readable without `qmtx_`, what waiters poll
+  std::atomic<std::size_t> size_;
+  Waiter not_empty_;
+  ChannelCounters counters_;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef _SLABPOOL_H_
+#define _SLABPOOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memplace.hpp>
+
+
+/*! \brief size-class block cache between one producer and the
+ *  threads that free its blocks
+ *  Sizes are rounded up to a class, four per power of two from
+ *  `kMinBlock` to `kMaxBlock`, so a block is at most 25% larger than
+ *  asked for. Larger buffers bypass the pool.
+ *
+ *  The producer keeps a private free list per class. Any thread
+ *  returns a block with `give`, a lock-free push onto the class'
+ *  return stack; the producer takes the whole stack with one
+ *  exchange once its private list runs dry. Neither side takes the
+ *  allocator's locks for a recycled block.
+ *
+ *  The pool never limits itself: its owner charges `blockSize` for
+ *  every fresh block against its budget and calls `trim` when the
+ *  cached blocks must give their memory back.
+ */
+class SlabPool {
+
+ public:
+
+  static const std::size_t kMinBlock = 64;
+  static const std::size_t kMaxBlock = 4 << 20;
+  // smaller blocks are not worth a mapping of their own
+  static const std::size_t kPlacedMinSize = 1 << 20;
+
+  SlabPool(const SlabPool&) = delete;
+  SlabPool& operator=(const SlabPool&) = delete;
+
+  explicit SlabPool(const MemPlacement& placement = MemPlacement());
+
+  ~SlabPool();
+
+  /*! \brief huge pages / prefault / NUMA node of blocks of at least
+   *  `kPlacedMinSize` bytes. Set before the first block is allocated.
+   */
+  void setPlacement(const MemPlacement& placement) { placement_ = placement; }
+
+  /*! \brief bytes a buffer of `size` bytes really takes */
+  static std::size_t blockSize(std::size_t size);
+
+  /*! \brief a cached block for `size` bytes, nullptr if none
+   *  Producer only.
+   */
+  void* take(std::size_t size);
+
+  /*! \brief a new block for `size` bytes from the system
+   *  Producer only. nullptr if the allocation failed.
+   */
+  void* allocate(std::size_t size);
+
+  /*! \brief return the block of a `size` byte buffer, from any thread
+   *  Return the bytes given back to the system: `blockSize(size)`
+   *  for a buffer too large for the pool, 0 for a cached block.
+   */
+  std::size_t give(void* block, std::size_t size);
+
+  /*! \brief free the block of a `size` byte buffer right away,
+   *  from any thread. Return `blockSize(size)`.
+   */
+  std::size_t discard(void* block, std::size_t size);
+
+  /*! \brief free every cached block, return the bytes freed
+   *  Producer only.
+   */
+  std::size_t trim();
+
+ private:
+
+  // in place in every cached block
+  struct Node {
+    Node* next;
+  };
+
+  static const std::size_t kClasses = 65;
+  static const std::size_t kCacheLine = 64;
+  // in front of a placed block: its mapped size, keeps 64B alignment
+  static const std::size_t kPlacedHeader = 64;
+
+  static std::size_t classOf(std::size_t size);
+  static std::size_t classSize(std::size_t cls);
+
+  void* systemAlloc(std::size_t bytes);
+  void systemFree(void* block, std::size_t bytes);
+
+  MemPlacement placement_;
+
+  // producer private
+  Node* free_[kClasses];
+  char pad0_[kCacheLine];
+
+  // pushed by any thread, emptied by the producer
+  std::atomic<Node*> returned_[kClasses];
+};
+
+#endif
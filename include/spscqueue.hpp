@@ -0,0 +1,255 @@
+#ifndef _SPSCQUEUE_H_
+#define _SPSCQUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <channelstats.hpp>
+#include <waitstrategy.hpp>
+
+
+/*! \brief lock-free FIFO between one producer and one consumer
+ *  Items are stored in place in fixed chunks linked into a list.
+ *  The producer fills the tail chunk and publishes every item with
+ *  one release store; the consumer drains the head chunk and hands
+ *  it back through a spare slot for the producer's next chunk, so
+ *  once warmed up neither side allocates or takes a lock. `push`
+ *  only costs a syscall when the consumer sleeps in its waiter.
+ *
+ *  Priority lanes and weights work as in `SafeQueue`. `push` is
+ *  producer only, everything else consumer only.
+ */
+template <typename T>
+class SpscQueue {
+
+ public:
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue& operator=(const SpscQueue&) = delete;
+
+  explicit SpscQueue(WaitStrategy wait = WaitStrategy::kBlocking, std::size_t lanes = 1,
+                     const std::vector<std::size_t>& weights = std::vector<std::size_t>())
+    : num_lanes_(lanes)
+    , lanes_(new Lane[lanes])
+    , weights_(weights)
+    , served_(lanes, 0)
+    , not_empty_(wait)
+  {
+    weights_.resize(lanes, 0);
+    for(std::size_t i = 0; i < num_lanes_; ++i){
+      Chunk* chunk = new Chunk();
+      lanes_[i].head = chunk;
+      lanes_[i].head_pos = 0;
+      lanes_[i].tail = chunk;
+      lanes_[i].tail_pos = 0;
+      lanes_[i].spare.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~SpscQueue() {
+    for(std::size_t i = 0; i < num_lanes_; ++i){
+      Chunk* chunk = lanes_[i].head;
+      while(chunk){
+        Chunk* next = chunk->next.load(std::memory_order_relaxed);
+        delete chunk;
+        chunk = next;
+      }
+      delete lanes_[i].spare.load(std::memory_order_relaxed);
+    }
+  }
+
+  void push(const T& item, std::size_t lane = 0) {
+    Lane& l = lanes_[lane];
+    if(l.tail_pos == kChunkItems){
+      Chunk* chunk = l.spare.exchange(nullptr, std::memory_order_acquire);
+      if(chunk == nullptr){
+        chunk = new Chunk();
+      }else{
+        chunk->written.store(0, std::memory_order_relaxed);
+        chunk->next.store(nullptr, std::memory_order_relaxed);
+      }
+      l.tail->next.store(chunk, std::memory_order_release);
+      l.tail = chunk;
+      l.tail_pos = 0;
+    }
+    l.tail->items[l.tail_pos] = item;
+    l.tail->written.store(++l.tail_pos, std::memory_order_release);
+    counters_.in(0);
+    not_empty_.notify();
+  }
+
+  /*! \brief pop several items, see `SafeQueue::fpop_n`
+   *  Gives up at `deadline`, returning 0.
+   */
+  template <typename Accept>
+  std::size_t fpop_n(T* res, std::size_t max, Accept accept,
+                     Waiter::Clock::time_point deadline){
+    if(max == 0){
+      return 0;
+    }
+    if(!hasItem()){
+      StallTimer stall(counters_, false, deadline != Waiter::noWait());
+      if(!not_empty_.waitUntil([this] { return hasItem(); }, deadline)){
+        return 0;
+      }
+    }
+    std::size_t count = 0;
+    while(count < max){
+      std::size_t lane = pickLane();
+      T* item = front(lane);
+      if(item == nullptr){
+        break;
+      }
+      bool ok = accept(*item);
+      if(count > 0 && !ok){
+        break;
+      }
+      res[count++] = std::move(*item);
+      popFront(lane);
+    }
+    counters_.out(0, count);
+    return count;
+  }
+
+  /*! \brief pop the front item if there is one
+   *  Never waits and never arms the eventfd.
+   */
+  bool try_fpop(T& res) {
+    std::size_t lane = pickLane();
+    T* item = front(lane);
+    if(item == nullptr){
+      return false;
+    }
+    res = std::move(*item);
+    popFront(lane);
+    counters_.out(0);
+    return true;
+  }
+
+  int enableEvent() { return not_empty_.enableEvent(); }
+
+  int eventFd() const { return not_empty_.eventFd(); }
+
+  /*! \brief counters of the queue, in items, from any thread */
+  ChannelStats stats() const {
+    ChannelStats s = counters_.snapshot();
+    s.wakeups = not_empty_.wakeups();
+    return s;
+  }
+
+ private:
+
+  static const std::size_t kChunkItems = 256;
+  static const std::size_t kCacheLine = 64;
+
+  struct Chunk {
+    T items[kChunkItems];
+    // items published so far
+    std::atomic<std::size_t> written;
+    std::atomic<Chunk*> next;
+    Chunk(): written(0), next(nullptr) {}
+  };
+
+  // consumer and producer ends on their own cache lines
+  struct Lane {
+    Chunk* head;
+    std::size_t head_pos;
+    char pad0[kCacheLine];
+    Chunk* tail;
+    std::size_t tail_pos;
+    char pad1[kCacheLine];
+    // a drained chunk waiting for the producer, at most one
+    std::atomic<Chunk*> spare;
+  };
+
+  bool ready(std::size_t lane) const {
+    const Lane& l = lanes_[lane];
+    if(l.head_pos < kChunkItems){
+      return l.head_pos != l.head->written.load(std::memory_order_acquire);
+    }
+    // the producer links the next chunk before writing into it
+    Chunk* next = l.head->next.load(std::memory_order_acquire);
+    return next && next->written.load(std::memory_order_acquire) > 0;
+  }
+
+  bool hasItem() const {
+    for(std::size_t i = 0; i < num_lanes_; ++i){
+      if(ready(i)){
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // the highest lane with items, unless it used up its weight and
+  // passes the turn down to the next waiting one, which may pass
+  // it on in turn. Lane 0 if all are empty
+  std::size_t pickLane() const {
+    std::size_t lane = num_lanes_ - 1;
+    if(lane == 0){
+      return 0;
+    }
+    while(lane > 0 && !ready(lane)){
+      --lane;
+    }
+    for(std::size_t lower = lane; lower-- > 0;){
+      if(ready(lower)){
+        if(weights_[lane] == 0 || served_[lane] < weights_[lane]){
+          return lane;
+        }
+        lane = lower;
+      }
+    }
+    return lane;
+  }
+
+  // front item of `lane`, nullptr if none. Moves past a drained
+  // chunk and hands it back to the producer
+  T* front(std::size_t lane) {
+    Lane& l = lanes_[lane];
+    if(l.head_pos == kChunkItems){
+      Chunk* next = l.head->next.load(std::memory_order_acquire);
+      if(next == nullptr){
+        return nullptr;
+      }
+      Chunk* drained = l.head;
+      l.head = next;
+      l.head_pos = 0;
+      // the producer is done with it since it linked `next`
+      delete l.spare.exchange(drained, std::memory_order_acq_rel);
+    }
+    if(l.head_pos == l.head->written.load(std::memory_order_acquire)){
+      return nullptr;
+    }
+    return &l.head->items[l.head_pos];
+  }
+
+  // an item of `lane` was popped: it counts against the weight
+  // while a lower lane waits, the lanes above that passed their
+  // turn to it start over
+  void popFront(std::size_t lane) {
+    ++lanes_[lane].head_pos;
+    if(num_lanes_ == 1){
+      return;
+    }
+    bool waiting = false;
+    for(std::size_t lower = 0; lower < lane && !waiting; ++lower){
+      waiting = ready(lower);
+    }
+    served_[lane] = waiting ? served_[lane] + 1 : 0;
+    for(std::size_t upper = lane + 1; upper < num_lanes_; ++upper){
+      served_[upper] = 0;
+    }
+  }
+
+  std::size_t num_lanes_;
+  std::unique_ptr<Lane[]> lanes_;
+  // consumer private
+  std::vector<std::size_t> weights_;
+  std::vector<std::size_t> served_;
+  Waiter not_empty_;
+  ChannelCounters counters_;
+};
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef _TYPEDRING_H_
+#define _TYPEDRING_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <waitstrategy.hpp>
+
+
+/*! \brief ring of `Capacity` fixed-size `T` records between one
+ *  producer and one consumer
+ *  Header-only counterpart of `RingBuffer` for fixed-size records:
+ *  no record headers, no padding, and slots are found by masking the
+ *  monotonic cursors with `Capacity - 1` instead of a division.
+ *  Records are constructed in place (`emplace` / `push`) and
+ *  destroyed by `consume`.
+ *  Same read / consume protocol as `RingBuffer`: `read` hands out
+ *  the next record without copy, `consume` releases the oldest read
+ *  record.
+ *  The slots are part of the object, so a large ring should be
+ *  allocated with `new`.
+ */
+template <typename T, std::size_t Capacity>
+class TypedRing {
+
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+                "TypedRing: Capacity must be a power of two");
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+                "TypedRing: over-aligned records are not supported");
+  static_assert(std::is_nothrow_destructible<T>::value,
+                "TypedRing: records must be nothrow destructible");
+
+ public:
+
+  typedef T value_type;
+
+  TypedRing(const TypedRing&) = delete;
+  TypedRing& operator=(const TypedRing&) = delete;
+
+  explicit TypedRing(WaitStrategy wait = WaitStrategy::kSpinFutex)
+      : writer_(0), cached_consumer_(0), consumer_(0),
+        reader_(0), cached_writer_(0),
+        not_full_(wait), not_empty_(wait) {}
+
+  ~TypedRing() {
+    std::size_t writer = writer_.load(std::memory_order_acquire);
+    for(std::size_t i = consumer_.load(std::memory_order_relaxed); i != writer; ++i){
+      slot(i)->~T();
+    }
+  }
+
+  static constexpr std::size_t capacity() { return Capacity; }
+
+  /*! \brief construct a record in the next slot
+   *  Block until a slot is free.
+   */
+  template <typename... Args>
+  void emplace(Args&&... args) {
+    emplaceUntil(Waiter::forever(), std::forward<Args>(args)...);
+  }
+
+  /*! \brief `emplace` that never blocks
+   *  Return false if the ring is full right now.
+   */
+  template <typename... Args>
+  bool try_emplace(Args&&... args) {
+    return emplaceUntil(Waiter::noWait(), std::forward<Args>(args)...);
+  }
+
+  void push(const T& item) { emplace(item); }
+  void push(T&& item) { emplace(std::move(item)); }
+  bool try_push(const T& item) { return try_emplace(item); }
+  bool try_push(T&& item) { return try_emplace(std::move(item)); }
+
+  /*! \brief the next unread record, without copy
+   *  Block until one is published. It stays valid until consumed.
+   */
+  T& read() {
+    T* item = nullptr;
+    readUntil(&item, Waiter::forever());
+    return *item;
+  }
+
+  /*! \brief `read` that never blocks
+   *  Return false if no record is ready right now.
+   */
+  bool try_read(T** item) {
+    return readUntil(item, Waiter::noWait());
+  }
+
+  bool read_for(T** item, std::chrono::milliseconds timeout) {
+    return readUntil(item, Waiter::deadlineAfter(timeout));
+  }
+
+  /*! \brief destroy the oldest read record and free its slot */
+  void consume() {
+    consumeN(1);
+  }
+
+  /*! \brief consume the `n` oldest read records
+   *  Never more than were read: the rest of `n` is ignored.
+   */
+  void consumeN(std::size_t n) {
+    std::size_t consumer = consumer_.load(std::memory_order_relaxed);
+    if(n > reader_ - consumer){
+      std::cerr << "Error: consume call and read call number should match" << std::endl;
+      n = reader_ - consumer;
+    }
+    for(std::size_t i = 0; i < n; ++i){
+      slot(consumer + i)->~T();
+    }
+    consumer_.store(consumer + n, std::memory_order_release);
+    not_full_.notify();
+  }
+
+  /*! \brief move the next record out and consume it */
+  void pop(T& item) {
+    item = std::move(read());
+    consume();
+  }
+
+ private:
+
+  static const std::size_t kCacheLine = 64;
+  static const std::size_t kMask = Capacity - 1;
+
+  typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+  T* slot(std::size_t ofs) {
+    return reinterpret_cast<T*>(&slots_[ofs & kMask]);
+  }
+
+  template <typename... Args>
+  bool emplaceUntil(Waiter::Clock::time_point deadline, Args&&... args) {
+    std::size_t writer = writer_.load(std::memory_order_relaxed);
+    if(writer - cached_consumer_ == Capacity){
+      bool ok = not_full_.waitUntil([&] {
+        cached_consumer_ = consumer_.load(std::memory_order_acquire);
+        return writer - cached_consumer_ != Capacity;
+      }, deadline);
+      if(!ok){
+        return false;
+      }
+    }
+    new (slot(writer)) T(std::forward<Args>(args)...);
+    writer_.store(writer + 1, std::memory_order_release);
+    not_empty_.notify();
+    return true;
+  }
+
+  bool readUntil(T** item, Waiter::Clock::time_point deadline) {
+    if(reader_ == cached_writer_){
+      bool ok = not_empty_.waitUntil([&] {
+        cached_writer_ = writer_.load(std::memory_order_acquire);
+        return reader_ != cached_writer_;
+      }, deadline);
+      if(!ok){
+        return false;
+      }
+    }
+    *item = slot(reader_++);
+    return true;
+  }
+
+  // producer side
+  std::atomic<std::size_t> writer_;
+  std::size_t cached_consumer_;
+  char pad0_[kCacheLine];
+
+  // consumer side: release cursor, read cursor and last seen writer
+  std::atomic<std::size_t> consumer_;
+  std::size_t reader_;
+  std::size_t cached_writer_;
+  char pad1_[kCacheLine];
+
+  Waiter not_full_;
+  Waiter not_empty_;
+  char pad2_[kCacheLine];
+
+  Slot slots_[Capacity];
+};
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef _WAITSTRATEGY_H_
+#define _WAITSTRATEGY_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+
+/*! \brief how a blocked producer / consumer waits
+ *  `kBlocking`: sleep on a mutex + condition variable right away.
+ *  `kSpin`: busy-spin with a pause instruction, never sleep.
+ *           Lowest latency, burns a core per waiting thread.
+ *  `kSpinYield`: spin for a while, then keep polling with
+ *                `std::this_thread::yield`.
+ *  `kSpinFutex`: spin for a while, then sleep on a futex.
+ */
+enum class WaitStrategy { kBlocking, kSpin, kSpinYield, kSpinFutex };
+
+// spins before `kSpinYield` / `kSpinFutex` stop busy-waiting
+static const unsigned kWaitSpinLimit = 128;
+
+inline void cpuRelax(){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+/*! \brief futex sleep while `*word == val`, at most `timeout_ns`
+ *  nanoseconds if it is not negative. Works across processes.
+ */
+void futexWait(std::atomic<std::uint32_t>* word, std::uint32_t val,
+               std::int64_t timeout_ns = -1);
+
+void futexWake(std::atomic<std::uint32_t>* word, bool all);
+
+/*! \brief sleeper bookkeeping of one wait condition
+ *  Plain data so it can live in shared memory.
+ */
+struct WaitWord {
+  // threads past the spin phase
+  std::atomic<int> waiting;
+  // futex word, bumped on every wakeup
+  std::atomic<std::uint32_t> seq;
+
+  void init() {
+    waiting.store(0, std::memory_order_relaxed);
+    seq.store(0, std::memory_order_relaxed);
+  }
+};
+
+/*! \brief wait for / signal one condition with a `WaitStrategy`
+ *  The condition is a predicate over state the signaling side
+ *  publishes with release stores before calling `notify`.
+ *  Waiters only pay for a lock or a syscall once they stop
+ *  spinning, and `notify` only when someone is asleep.
+ *
+ *  `attach` moves the bookkeeping into a `WaitWord` owned elsewhere,
+ *  e.g. in shared memory; a waiter shared between processes always
+ *  sleeps on the futex, `kBlocking` then just skips the spinning.
+ *
+ *  `enableEvent` adds an eventfd for event loops: a wait that gives
+ *  up arms it, and the next `notify` makes it readable. The waiter
+ *  drains it again when it arms it, so it should be polled by one
+ *  thread only.
+ */
+class Waiter {
+
+ public:
+
+  typedef std::chrono::steady_clock Clock;
+
+  // deadlines of a wait that never gives up / doesn't wait at all
+  static Clock::time_point forever() { return Clock::time_point::max(); }
+  static Clock::time_point noWait() { return Clock::time_point::min(); }
+
+  static Clock::time_point deadlineAfter(std::chrono::nanoseconds timeout) {
+    return timeout <= std::chrono::nanoseconds::zero() ? noWait()
+                                                      : Clock::now() + timeout;
+  }
+
+  Waiter(const Waiter&) = delete;
+  Waiter& operator=(const Waiter&) = delete;
+
+  explicit Waiter(WaitStrategy strategy = WaitStrategy::kBlocking)
+      : strategy_(strategy), word_(&own_), shared_(false),
+        event_fd_(-1), armed_(false), wakeups_(0) {
+    own_.init();
+  }
+
+  ~Waiter();
+
+  void attach(WaitWord* word, bool shared) {
+    word_ = word;
+    shared_ = shared;
+  }
+
+  WaitStrategy strategy() const { return strategy_; }
+
+  /*! \brief create the eventfd, return it or -1 on failure */
+  int enableEvent();
+
+  int eventFd() const { return event_fd_; }
+
+  /*! \brief notifies so far that woke a sleeper or signaled the eventfd */
+  std::uint64_t wakeups() const { return wakeups_.load(std::memory_order_relaxed); }
+
+  /*! \brief return once `ready()` is true */
+  template <typename Ready>
+  void wait(Ready ready) {
+    waitUntil(ready, forever());
+  }
+
+  /*! \brief like `wait`, but give up at `deadline`
+   *  Return the last value of `ready()`.
+   */
+  template <typename Ready>
+  bool waitUntil(Ready ready, Clock::time_point deadline) {
+    if(spin(ready, deadline)){
+      return true;
+    }
+    if(deadline != noWait() && sleeps() && sleep(ready, deadline)){
+      return true;
+    }
+    return arm(ready);
+  }
+
+  template <typename Ready>
+  bool waitFor(Ready ready, std::chrono::nanoseconds timeout) {
+    return waitUntil(ready, deadlineAfter(timeout));
+  }
+
+  /*! \brief wake waiters after the condition may have turned true
+   *  `all`: wake every sleeper, e.g. when they wait for different
+   *         amounts of space.
+   */
+  void notify(bool all = false) {
+    if(event_fd_ < 0 && !shared_ && (strategy_ == WaitStrategy::kSpin ||
+                                     strategy_ == WaitStrategy::kSpinYield)){
+      return;
+    }
+    // pairs with the fences in `sleep` / `arm`: either the waiter
+    // sees the published state, or we see it waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(event_fd_ >= 0 && armed_.load(std::memory_order_relaxed) &&
+       armed_.exchange(false, std::memory_order_relaxed)){
+      wakeups_.fetch_add(1, std::memory_order_relaxed);
+      signalEvent();
+    }
+    if(word_->waiting.load(std::memory_order_relaxed) == 0){
+      return;
+    }
+    wakeups_.fetch_add(1, std::memory_order_relaxed);
+    if(useFutex()){
+      word_->seq.fetch_add(1, std::memory_order_release);
+      futexWake(&word_->seq, all);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mtx_);
+    if(all){
+      cv_.notify_all();
+    }else{
+      cv_.notify_one();
+    }
+  }
+
+ private:
+
+  bool useFutex() const {
+    return shared_ || strategy_ == WaitStrategy::kSpinFutex;
+  }
+
+  bool sleeps() const {
+    return useFutex() || strategy_ == WaitStrategy::kBlocking;
+  }
+
+  void signalEvent();
+  void drainEvent();
+
+  // spin phase, true once `ready()` holds. `kSpin` / `kSpinYield`
+  // stay here until then or until `deadline`
+  template <typename Ready>
+  bool spin(Ready& ready, Clock::time_point deadline) {
+    if(strategy_ == WaitStrategy::kBlocking || deadline == noWait()){
+      return ready();
+    }
+    for(unsigned spin = 0; !ready(); ++spin){
+      if(useFutex() && spin >= kWaitSpinLimit){
+        return false;
+      }
+      // reading the clock costs more than a pause, check it rarely
+      if((spin & (kWaitSpinLimit - 1)) == kWaitSpinLimit - 1 &&
+         deadline != forever() && Clock::now() >= deadline){
+        return ready();
+      }
+      if(strategy_ == WaitStrategy::kSpinYield && spin >= kWaitSpinLimit){
+        std::this_thread::yield();
+      }else{
+        cpuRelax();
+      }
+    }
+    return true;
+  }
+
+  template <typename Ready>
+  bool sleep(Ready& ready, Clock::time_point deadline) {
+    bool ok = true;
+    word_->waiting.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(useFutex()){
+      while(true){
+        std::uint32_t seq = word_->seq.load(std::memory_order_acquire);
+        if(ready()){
+          break;
+        }
+        std::int64_t timeout_ns = -1;
+        if(deadline != forever()){
+          timeout_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+              deadline - Clock::now()).count();
+          if(timeout_ns <= 0){
+            ok = ready();
+            break;
+          }
+        }
+        futexWait(&word_->seq, seq, timeout_ns);
+      }
+    }else{
+      std::unique_lock<std::mutex> lock(mtx_);
+      if(deadline == forever()){
+        cv_.wait(lock, ready);
+      }else{
+        ok = cv_.wait_until(lock, deadline, ready);
+      }
+    }
+    word_->waiting.fetch_sub(1, std::memory_order_relaxed);
+    return ok;
+  }
+
+  // a wait gave up: make the next `notify` signal the eventfd
+  template <typename Ready>
+  bool arm(Ready& ready) {
+    if(event_fd_ < 0){
+      return false;
+    }
+    drainEvent();
+    armed_.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return ready();
+  }
+
+  WaitStrategy strategy_;
+  WaitWord* word_;
+  bool shared_;
+  WaitWord own_;
+  int event_fd_;
+  std::atomic<bool> armed_;
+  std::atomic<std::uint64_t> wakeups_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include <memgovernor.hpp>
+
+#include <algorithm>
+
+MemoryGovernor::MemoryGovernor(std::size_t limit)
+    : limit_(limit), reserved_(0), shared_used_(0), queued_(0), waking_(0) {}
+
+MemoryGovernor::~MemoryGovernor(){
+}
+
+MemoryGovernor::Member* MemoryGovernor::attach(std::size_t min, std::size_t max,
+                                               Waiter* waiter){
+  std::lock_guard<std::mutex> lock(mtx_);
+  std::size_t reserved = reserved_.load(std::memory_order_relaxed);
+  if(min > max || min > limit_ - reserved){
+    return nullptr;
+  }
+  reserved_.store(reserved + min, std::memory_order_release);
+  Member* member = new Member();
+  member->min = min;
+  member->max = max;
+  member->waiter = waiter;
+  member->waiting = false;
+  member->queued = false;
+  return member;
+}
+
+void MemoryGovernor::detach(Member* member){
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    reserved_.fetch_sub(member->min, std::memory_order_release);
+  }
+  // a wakeup picked while it was queued may still be on its way
+  while(waking_.load(std::memory_order_acquire) > 0){
+    std::this_thread::yield();
+  }
+  delete member;
+}
+
+// shared bytes left once every minimum is set aside
+bool MemoryGovernor::take(std::size_t bytes){
+  std::size_t used = shared_used_.load(std::memory_order_acquire);
+  while(used + bytes <= limit_ - reserved_.load(std::memory_order_acquire)){
+    if(shared_used_.compare_exchange_weak(used, used + bytes, std::memory_order_acq_rel)){
+      return true;
+    }
+  }
+  return false;
+}
+
+bool MemoryGovernor::admit(Member* member, std::size_t before, std::size_t after){
+  if(after > member->max){
+    return false;
+  }
+  std::size_t bytes = excess(member, after) - excess(member, before);
+  if(bytes == 0){
+    return true;
+  }
+  if(bytes > limit_ - reserved_.load(std::memory_order_acquire)){
+    // never fits, don't hold up the queue for it
+    return false;
+  }
+  if(queued_.load(std::memory_order_acquire) == 0){
+    if(take(bytes)){
+      return true;
+    }
+    if(!member->waiting){
+      return false;
+    }
+  }
+  std::unique_lock<std::mutex> lock(mtx_);
+  if(!queue_.empty() && queue_.front() != member){
+    // queue up behind the members refused earlier
+    if(member->waiting && !member->queued){
+      member->queued = true;
+      queue_.push_back(member);
+      queued_.fetch_add(1, std::memory_order_release);
+    }
+    return false;
+  }
+  if(take(bytes)){
+    if(member->queued){
+      // the next one is woken by `endWait`
+      member->queued = false;
+      queue_.pop_front();
+      queued_.fetch_sub(1, std::memory_order_release);
+    }
+    return true;
+  }
+  if(member->waiting && !member->queued){
+    member->queued = true;
+    queue_.push_back(member);
+    queued_.fetch_add(1, std::memory_order_release);
+  }
+  return false;
+}
+
+void MemoryGovernor::account(Member* member, std::size_t before, std::size_t after){
+  std::size_t from = excess(member, before);
+  std::size_t to = excess(member, after);
+  if(to > from){
+    shared_used_.fetch_add(to - from, std::memory_order_acq_rel);
+  }else if(from > to){
+    shared_used_.fetch_sub(from - to, std::memory_order_acq_rel);
+  }
+}
+
+void MemoryGovernor::wakeWaiting(){
+  if(queued_.load(std::memory_order_acquire) > 0){
+    std::unique_lock<std::mutex> lock(mtx_);
+    Waiter* next = head();
+    lock.unlock();
+    wake(next);
+  }
+}
+
+void MemoryGovernor::beginWait(Member* member){
+  std::lock_guard<std::mutex> lock(mtx_);
+  member->waiting = true;
+}
+
+void MemoryGovernor::endWait(Member* member){
+  std::unique_lock<std::mutex> lock(mtx_);
+  member->waiting = false;
+  if(member->queued){
+    member->queued = false;
+    queue_.erase(std::find(queue_.begin(), queue_.end(), member));
+    queued_.fetch_sub(1, std::memory_order_release);
+  }
+  // granted or gone, the next one may fit now
+  Waiter* next = head();
+  lock.unlock();
+  wake(next);
+}
+
+// under `mtx_`: waiter of the first queued member, nullptr if none.
+// Its member can't detach until `wake` is done with it
+Waiter* MemoryGovernor::head(){
+  if(queue_.empty()){
+    return nullptr;
+  }
+  waking_.fetch_add(1, std::memory_order_relaxed);
+  return queue_.front()->waiter;
+}
+
+// outside `mtx_`: a waiting member checks `admit` under its
+// waiter's lock
+void MemoryGovernor::wake(Waiter* waiter){
+  if(waiter){
+    waiter->notify();
+    waking_.fetch_sub(1, std::memory_order_release);
+  }
+}
@@ -0,0 +1,97 @@
+#include <memplace.hpp>
+
+#include <atomic>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// from <numaif.h>, kept here to avoid linking libnuma
+static const int kMpolBind = 2;
+static const unsigned kMpolMfMove = 1 << 1;
+static const int kMaxNumaNodes = 1024;
+
+// warn about a missing hugetlbfs pool only once per process
+static std::atomic<bool> huge_warned(false);
+
+static std::size_t roundUp(std::size_t size, std::size_t align){
+  return (size + align - 1) / align * align;
+}
+
+static void bindNode(void* ptr, std::size_t size, int node){
+  if(node < 0 || node >= kMaxNumaNodes){
+    return;
+  }
+  unsigned long mask[kMaxNumaNodes / (8 * sizeof(unsigned long))] = {0};
+  mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+  if(syscall(SYS_mbind, ptr, size, kMpolBind, mask, kMaxNumaNodes, kMpolMfMove) != 0){
+    std::cerr << "Warning: mbind to NUMA node " << node << " failed" << std::endl;
+  }
+}
+
+static void prefault(void* ptr, std::size_t size){
+  std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  volatile char* p = static_cast<volatile char*>(ptr);
+  for(std::size_t ofs = 0; ofs < size; ofs += page){
+    p[ofs] = p[ofs];
+  }
+}
+
+void* placeAlloc(std::size_t& size, const MemPlacement& placement){
+  std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  void* ptr = MAP_FAILED;
+  HugePages huge = placement.huge_pages;
+  if(huge == HugePages::kExplicit){
+    std::size_t huge_size = roundUp(size, kHugePageSize);
+    ptr = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(ptr != MAP_FAILED){
+      size = huge_size;
+    }else{
+      if(!huge_warned.exchange(true)){
+        std::cerr << "Warning: no explicit huge page available, use transparent huge page" << std::endl;
+      }
+      huge = HugePages::kTransparent;
+    }
+  }
+  if(ptr == MAP_FAILED){
+    size = roundUp(size, huge == HugePages::kTransparent ? kHugePageSize : page);
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ptr == MAP_FAILED){
+      return nullptr;
+    }
+    if(huge == HugePages::kTransparent){
+      madvise(ptr, size, MADV_HUGEPAGE);
+    }
+  }
+  bindNode(ptr, size, placement.numa_node);
+  if(placement.prefault){
+    prefault(ptr, size);
+  }
+  return ptr;
+}
+
+void placeFree(void* ptr, std::size_t size){
+  if(ptr){
+    munmap(ptr, size);
+  }
+}
+
+void placeApply(void* ptr, std::size_t size, const MemPlacement& placement){
+  if(placement.huge_pages != HugePages::kNone){
+    madvise(ptr, size, MADV_HUGEPAGE);
+  }
+  bindNode(ptr, size, placement.numa_node);
+  if(placement.prefault){
+    prefault(ptr, size);
+  }
+}
+
+int currentNumaNode(){
+  unsigned cpu = 0;
+  unsigned node = 0;
+  if(syscall(SYS_getcpu, &cpu, &node, nullptr) != 0){
+    return -1;
+  }
+  return static_cast<int>(node);
+}
@@ -1,81 +1,802 @@
 
 #include <porter.hpp>
 
+#include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <sys/mman.h>
+#include <unistd.h>
+
+Porter::Porter(const PorterOptions& options)
+    : pool_(options.placement)
+    , deleter_pool_()
+    , overwrite_(options.overwrite)
+    , next_seq_(0)
+    , dropped_(0)
+    , max_size_(0)
+    , current_size_(0)
+    , not_full_(options.wait)
+    , num_consumers_(options.consumers)
+    , next_queue_(0)
+    , consumers_(new Consumer[options.consumers])
+    , num_lanes_(options.lanes)
+    , lane_reserve_(options.lane_reserve)
+    , lane_used_(new std::atomic<std::size_t>[options.lanes])
+    , spill_fd_(-1)
+    , spill_limit_(options.spill_limit)
+    , spill_end_(0)
+    , spill_records_(0)
+    , spill_released_(0)
+    , spilled_(0)
+    , spill_window_(nullptr)
+    , governor_(options.governor)
+    , member_(nullptr)
+    , auto_min_(options.auto_size_min)
+    , auto_max_(options.auto_size_max)
+    , pending_(0)
+    , auto_since_(Waiter::Clock::now())
+    , auto_stalled_(0)
+    , auto_writes_(0)
+    , auto_peak_(0)
+    , auto_spills_(0)
+    , auto_light_(0)
+    , grows_(0)
+    , shrinks_(0)
+    , released_(0) {
+  if(num_consumers_ == 0){
+    throw std::invalid_argument("Porter: needs at least one consumer");
+  }
+  if(num_consumers_ > 1 && (options.overwrite || options.event_fds)){
+    throw std::invalid_argument("Porter: overwrite and event fds need a single consumer");
+  }
+  if(num_lanes_ == 0 || (num_lanes_ > 1 && options.overwrite)){
+    throw std::invalid_argument("Porter: needs at least one lane, overwrite only one");
+  }
+  if((!options.lane_weights.empty() && options.lane_weights.size() != num_lanes_) ||
+     (!lane_reserve_.empty() && lane_reserve_.size() != num_lanes_)){
+    throw std::invalid_argument("Porter: lane weights and reserves need one entry per lane");
+  }
+  lane_reserve_.resize(num_lanes_, 0);
+  for(std::size_t i = 0; i < num_lanes_; ++i){
+    lane_used_[i].store(0, std::memory_order_relaxed);
+  }
+  if(num_consumers_ == 1 && !overwrite_){
+    log_.reset(new SpscQueue<Item>(options.wait, num_lanes_, options.lane_weights));
+  }else{
+    for(std::size_t i = 0; i < num_consumers_; ++i){
+      logs_.emplace_back(new SafeQueue<Item>(options.wait, num_lanes_, options.lane_weights));
+    }
+  }
+  if(!options.spill_path.empty() && (num_consumers_ > 1 || options.overwrite)){
+    throw std::invalid_argument("Porter: spilling needs a single consumer, no overwrite");
+  }
+  if(options.event_fds && (not_full_.enableEvent() < 0 ||
+                           (log_ ? log_->enableEvent() : logs_[0]->enableEvent()) < 0)){
+    throw std::runtime_error("Porter: eventfd failed");
+  }
+  if(auto_max_ > 0){
+    if(auto_min_ == 0 || auto_min_ > auto_max_){
+      throw std::invalid_argument("Porter: auto size needs 0 < min <= max");
+    }
+    max_size_.store(auto_min_, std::memory_order_relaxed);
+  }
+  if(!options.spill_path.empty()){
+    spill_fd_ = open(options.spill_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(spill_fd_ < 0){
+      throw std::runtime_error("Porter: can't create spill file " + options.spill_path);
+    }
+    // nobody else needs it, gone with the last descriptor
+    unlink(options.spill_path.c_str());
+  }
+  // last: nothing may throw once the governor set our minimum aside
+  if(governor_){
+    member_ = governor_->attach(options.governor_min, options.governor_max, &not_full_);
+    if(member_ == nullptr){
+      if(spill_fd_ >= 0){
+        close(spill_fd_);
+      }
+      throw std::invalid_argument("Porter: governor can't guarantee the minimum");
+    }
+  }
+}
+
+// hand a block back to the pool, or an adopted buffer to its
+// deleter, and uncharge what was freed
+void Porter::release(const Item& item){
+  std::size_t freed = item.size;
+  if(auto_max_ > 0 && !isSpilled(item)){
+    pending_.fetch_sub(item.size, std::memory_order_relaxed);
+  }
+  if(num_lanes_ > 1 && !isSpilled(item)){
+    std::size_t bytes = item.deleter ? item.size : SlabPool::blockSize(item.size);
+    lane_used_[item.lane].fetch_sub(bytes, std::memory_order_relaxed);
+  }
+  if(isSpilled(item)){
+    // never charged
+    freed = 0;
+    item.deleter(item.buffer, item.context);
+  }else if(item.deleter){
+    item.deleter(item.buffer, item.context);
+  }else if(governor_ && governor_->contended()){
+    // other Porters wait for the budget a cached block would keep
+    freed = pool_.discard(item.buffer, item.size);
+  }else{
+    freed = pool_.give(item.buffer, item.size);
+  }
+  if(freed){
+    uncharge(freed);
+    if(governor_){
+      governor_->wakeWaiting();
+    }
+  }
+}
+
+// take `size` bytes of the budget if they fit under `limit`, and
+// of the governor's if there is one
+bool Porter::charge(std::size_t size, std::size_t limit){
+  std::size_t current = current_size_.load(std::memory_order_acquire);
+  while(current + size <= limit){
+    if(current_size_.compare_exchange_weak(current, current + size,
+                                           std::memory_order_acq_rel)){
+      if(governor_ && !governor_->admit(member_, current, current + size)){
+        // report the refused growth too, releases in between
+        // were reported against it
+        governor_->account(member_, current, current + size);
+        uncharge(size);
+        return false;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+void Porter::uncharge(std::size_t size){
+  std::size_t current = current_size_.fetch_sub(size, std::memory_order_release);
+  if(governor_){
+    governor_->account(member_, current, current - size);
+  }
+}
+
+// budget `lane` may fill: what the other lanes' reserves don't
+// keep back
+std::size_t Porter::laneLimit(std::size_t lane) const {
+  std::size_t max = max_size_.load(std::memory_order_acquire);
+  if(num_lanes_ == 1){
+    return max;
+  }
+  std::size_t kept = 0;
+  for(std::size_t i = 0; i < num_lanes_; ++i){
+    std::size_t used = lane_used_[i].load(std::memory_order_relaxed);
+    if(i != lane && used < lane_reserve_[i]){
+      kept += lane_reserve_[i] - used;
+    }
+  }
+  return kept < max ? max - kept : 0;
+}
+
+// a block for a `size` byte buffer: a cached one, else a new one
+// if its size fits the budget once the cache is trimmed. False if
+// it doesn't fit yet; true with `*buffer` nullptr if malloc failed.
+// Without `buffer` just charge `size` bytes for an adopted buffer.
+// With lanes a cached block must fit `lane`'s share as well
+bool Porter::obtain(std::size_t size, void** buffer, std::size_t lane){
+  std::size_t bytes = buffer ? SlabPool::blockSize(size) : size;
+  std::size_t limit = laneLimit(lane);
+  if(buffer){
+    std::size_t held = 0;
+    for(std::size_t i = 0; num_lanes_ > 1 && i < num_lanes_; ++i){
+      held += lane_used_[i].load(std::memory_order_relaxed);
+    }
+    *buffer = num_lanes_ == 1 || held + bytes <= limit ? pool_.take(size) : nullptr;
+    if(*buffer){
+      if(num_lanes_ > 1){
+        lane_used_[lane].fetch_add(bytes, std::memory_order_relaxed);
+      }
+      return true;
+    }
+  }
+  if(!charge(bytes, limit)){
+    std::size_t freed = pool_.trim();
+    if(freed == 0){
+      return false;
+    }
+    uncharge(freed);
+    if(!charge(bytes, limit)){
+      return false;
+    }
+  }
+  if(buffer){
+    *buffer = pool_.allocate(size);
+    if(*buffer == nullptr){
+      uncharge(bytes);
+      return true;
+    }
+  }
+  if(num_lanes_ > 1){
+    lane_used_[lane].fetch_add(bytes, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+// `obtain` with the write's wait, or in overwrite mode dropping the
+// oldest unread buffers until it succeeds. False if it can't, the
+// new buffer is dropped then
+bool Porter::acquire(std::size_t size, void** buffer, std::size_t lane,
+                     Waiter::Clock::time_point deadline){
+  if(overwrite_){
+    while(!obtain(size, buffer, lane)){
+      Item oldest;
+      if(!logs_[0]->try_fpop(oldest)){
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        ++next_seq_;
+        return false;
+      }
+      release(oldest);
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }else if(!obtain(size, buffer, lane)){
+    StallTimer stall(counters_, true, deadline != Waiter::noWait());
+    if(!waitBudget(size, buffer, lane, deadline)){
+      return false;
+    }
+  }
+  counters_.occupancy(current_size_.load(std::memory_order_relaxed));
+  return true;
+}
+
+// wait until `obtain` succeeds. With a governor or auto sizing the
+// wait is cut in slices: a release inside another Porter's wait
+// can't wake this one, and a stalled producer grows its own budget
+bool Porter::waitBudget(std::size_t size, void** buffer, std::size_t lane,
+                        Waiter::Clock::time_point deadline){
+  auto ready = [&] { return obtain(size, buffer, lane); };
+  if(!governor_ && auto_max_ == 0){
+    return not_full_.waitUntil(ready, deadline);
+  }
+  if(governor_){
+    governor_->beginWait(member_);
+  }
+  bool ok = false;
+  while(true){
+    Waiter::Clock::time_point start = Waiter::Clock::now();
+    Waiter::Clock::time_point slice = start + std::chrono::microseconds(MemoryGovernor::kPollUs);
+    ok = not_full_.waitUntil(ready, std::min(slice, deadline));
+    Waiter::Clock::time_point now = Waiter::Clock::now();
+    if(auto_max_ > 0){
+      auto_stalled_ += now - start;
+    }
+    if(ok || deadline == Waiter::noWait() || now >= deadline){
+      break;
+    }
+    if(auto_max_ > 0){
+      autoSize();
+    }
+  }
+  if(governor_){
+    governor_->endWait(member_);
+  }
+  return ok;
+}
+
+// once per interval: double the budget if the producer stalled or
+// spilled, halve it and free the cached blocks if the consumer kept
+// up for a while
+void Porter::autoSize(){
+  Waiter::Clock::time_point now = Waiter::Clock::now();
+  if(now - auto_since_ < std::chrono::milliseconds(kAutoSizeIntervalMs)){
+    return;
+  }
+  std::size_t budget = max_size_.load(std::memory_order_relaxed);
+  std::chrono::nanoseconds interval = now - auto_since_;
+  if(auto_stalled_ * kAutoGrowStall >= interval || auto_spills_ > 0){
+    auto_light_ = 0;
+    std::size_t grown = budget > auto_max_ / 2 ? auto_max_ : budget * 2;
+    if(grown > budget){
+      max_size_.store(grown, std::memory_order_release);
+      grows_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }else if(auto_peak_ * kAutoShrinkUse < budget){
+    // a quiet stretch between two writes counts for its length
+    auto_light_ += interval / std::chrono::milliseconds(kAutoSizeIntervalMs);
+    if(auto_light_ >= kAutoShrinkIntervals){
+      auto_light_ = 0;
+      std::size_t shrunk = budget / 2 < auto_min_ ? auto_min_ : budget / 2;
+      if(shrunk < budget){
+        max_size_.store(shrunk, std::memory_order_release);
+        std::size_t freed = pool_.trim();
+        if(freed){
+          uncharge(freed);
+        }
+#ifdef __GLIBC__
+        // small blocks only go back to the OS from the malloc arenas
+        malloc_trim(0);
+#endif
+        shrinks_.fetch_add(1, std::memory_order_relaxed);
+        released_.fetch_add(freed, std::memory_order_relaxed);
+      }
+    }
+  }else{
+    auto_light_ = 0;
+  }
+  auto_since_ = now;
+  auto_stalled_ = Waiter::Clock::duration(0);
+  auto_peak_ = pending_.load(std::memory_order_relaxed);
+  auto_spills_ = 0;
+}
+
+AutoSizeStats Porter::autoSizeStats() const {
+  AutoSizeStats s;
+  s.budget = max_size_.load(std::memory_order_relaxed);
+  s.footprint = current_size_.load(std::memory_order_relaxed);
+  s.grows = grows_.load(std::memory_order_relaxed);
+  s.shrinks = shrinks_.load(std::memory_order_relaxed);
+  s.released_bytes = released_.load(std::memory_order_relaxed);
+  return s;
+}
+
+void Porter::publish(Item& item){
+  item.seq = next_seq_++;
+  counters_.in(item.size);
+  if(auto_max_ > 0){
+    if(!isSpilled(item)){
+      std::size_t pending = pending_.fetch_add(item.size, std::memory_order_relaxed) + item.size;
+      auto_peak_ = std::max(auto_peak_, pending);
+    }
+    if(++auto_writes_ % kAutoSizeCheck == 0){
+      autoSize();
+    }
+  }
+  if(log_){
+    log_->push(item, item.lane);
+    return;
+  }
+  logs_[next_queue_]->push(item, item.lane);
+  if(++next_queue_ == num_consumers_){
+    next_queue_ = 0;
+  }
+}
+
 void Porter::write(const void* buffer, std::size_t size){
-  
-  std::unique_lock<std::mutex> lock(size_mtx_);
-  while(current_size_ + size > max_size_){
-    not_full_.wait(lock);
+  write(0, buffer, size);
+}
+
+void Porter::write(std::size_t lane, const void* buffer, std::size_t size){
+  struct iovec iov = {const_cast<void*>(buffer), size};
+  writeUntil(lane, &iov, 1, Waiter::forever());
+}
+
+void Porter::writev(const struct iovec* iov, std::size_t count){
+  writeUntil(0, iov, count, Waiter::forever());
+}
+
+void Porter::writev(std::size_t lane, const struct iovec* iov, std::size_t count){
+  writeUntil(lane, iov, count, Waiter::forever());
+}
+
+bool Porter::try_write(const void* buffer, std::size_t size){
+  return try_write(0, buffer, size);
+}
+
+bool Porter::try_write(std::size_t lane, const void* buffer, std::size_t size){
+  struct iovec iov = {const_cast<void*>(buffer), size};
+  return writeUntil(lane, &iov, 1, Waiter::noWait());
+}
+
+bool Porter::write_for(const void* buffer, std::size_t size,
+                       std::chrono::milliseconds timeout){
+  return write_for(0, buffer, size, timeout);
+}
+
+bool Porter::write_for(std::size_t lane, const void* buffer, std::size_t size,
+                       std::chrono::milliseconds timeout){
+  struct iovec iov = {const_cast<void*>(buffer), size};
+  return writeUntil(lane, &iov, 1, Waiter::deadlineAfter(timeout));
+}
+
+bool Porter::writeUntil(std::size_t lane, const struct iovec* iov, std::size_t count,
+                        Waiter::Clock::time_point deadline){
+  assert(lane < num_lanes_);
+  std::size_t size = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    size += iov[i].iov_len;
   }
-  current_size_ += size;
-  lock.unlock();
 
-  void* buff = static_cast<void*>(std::malloc(size));
+  void* block = nullptr;
+  if(spill_fd_ >= 0 && obtain(size, &block, lane)){
+    counters_.occupancy(current_size_.load(std::memory_order_relaxed));
+  }else if(spill_fd_ >= 0 && spill(lane, iov, count, size)){
+    return true;
+  }else if(!acquire(size, &block, lane, deadline)){
+    return false;
+  }
+
+  char* buff = static_cast<char*>(block);
   if(buff == nullptr){
     std::cerr << "Error: Memory allocation failed\n";
+    return false;
+  }
+  std::size_t ofs = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    memcpy(buff + ofs, iov[i].iov_base, iov[i].iov_len);
+    ofs += iov[i].iov_len;
+  }
+
+  Item item(buff, size);
+  item.lane = lane;
+  publish(item);
+  return true;
+}
+
+// out of budget: append the buffer to the spill file and queue its
+// offset. False if the file is full or the write failed
+bool Porter::spill(std::size_t lane, const struct iovec* iov, std::size_t count,
+                   std::size_t size){
+  if(spill_records_ == spill_released_.load(std::memory_order_acquire) && spill_end_ > 0){
+    // all consumed, start over and give the disk space back
+    if(spill_end_ > kSpillWindow && ftruncate(spill_fd_, 0) != 0){
+      std::cerr << "Error: spill file truncate failed\n";
+    }
+    spill_end_ = 0;
+  }
+  std::size_t len = size == 0 ? kSpillAlign : (size + kSpillAlign - 1) & ~(kSpillAlign - 1);
+  if(len > spill_limit_ || spill_end_ > spill_limit_ - len){
+    return false;
+  }
+  ssize_t n = pwritev(spill_fd_, iov, count, spill_end_);
+  if(n < 0 || static_cast<std::size_t>(n) != size){
+    std::cerr << "Error: spill file write failed\n";
+    return false;
+  }
+  Item item(nullptr, size);
+  item.lane = lane;
+  item.deleter = unspilled;
+  item.context = reinterpret_cast<void*>(static_cast<std::uintptr_t>(spill_end_));
+  spill_end_ += len;
+  ++spill_records_;
+  ++auto_spills_;
+  spilled_.fetch_add(1, std::memory_order_relaxed);
+  publish(item);
+  return true;
+}
+
+bool Porter::isSpilled(const Item& item){
+  return item.deleter == unspilled || item.deleter == unmapSpilled;
+}
+
+void Porter::unspilled(void*, void*){
+}
+
+void Porter::unmapSpilled(void*, void* context){
+  SpillWindow* window = static_cast<SpillWindow*>(context);
+  window->owner->spill_released_.fetch_add(1, std::memory_order_release);
+  if(--window->refs == 0 && !window->current){
+    dropWindow(window);
+  }
+}
+
+void Porter::dropWindow(SpillWindow* window){
+  if(window->mapped){
+    munmap(window->base, window->length);
+  }else{
+    std::free(window->base);
+  }
+  delete window;
+}
+
+// point a spilled buffer popped by the consumer at its bytes in the
+// file, through the current window if it lies inside
+void Porter::loadSpilled(Item& item){
+  std::uint64_t ofs = reinterpret_cast<std::uintptr_t>(item.context);
+  SpillWindow* window = spill_window_;
+  if(window == nullptr || !window->mapped || ofs < window->start ||
+     ofs + item.size > window->start + window->length){
+    window = mapWindow(ofs, item.size);
+  }
+  ++window->refs;
+  item.buffer = window->base + (ofs - window->start);
+  item.deleter = unmapSpilled;
+  item.context = window;
+}
+
+// map at least `kSpillWindow` bytes of the spill file from `ofs` and
+// ask the kernel to read them ahead. Falls back to reading just the
+// one buffer
+Porter::SpillWindow* Porter::mapWindow(std::uint64_t ofs, std::size_t size){
+  if(spill_window_){
+    spill_window_->current = false;
+    if(spill_window_->refs == 0){
+      dropWindow(spill_window_);
+    }
+  }
+  std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  SpillWindow* window = new SpillWindow();
+  window->owner = this;
+  window->refs = 0;
+  window->current = true;
+  window->mapped = true;
+  window->start = ofs & ~static_cast<std::uint64_t>(page - 1);
+  window->length = static_cast<std::size_t>(ofs - window->start) + size;
+  if(window->length < kSpillWindow){
+    window->length = kSpillWindow;
+  }
+  window->length = (window->length + page - 1) & ~(page - 1);
+  void* base = mmap(nullptr, window->length, PROT_READ, MAP_SHARED, spill_fd_, window->start);
+  if(base != MAP_FAILED){
+    madvise(base, window->length, MADV_SEQUENTIAL);
+    posix_fadvise(spill_fd_, window->start, window->length, POSIX_FADV_WILLNEED);
+    window->base = static_cast<char*>(base);
+  }else{
+    window->mapped = false;
+    window->start = ofs;
+    window->length = size;
+    window->base = static_cast<char*>(std::malloc(size == 0 ? 1 : size));
+    if(window->base == nullptr || pread(spill_fd_, window->base, size, ofs) !=
+                                     static_cast<ssize_t>(size)){
+      std::cerr << "Error: spill file read failed\n";
+    }
+  }
+  spill_window_ = window;
+  return window;
+}
+
+void Porter::write(std::unique_ptr<char[]> buffer, std::size_t size){
+  write(buffer.release(), size, deleteArray, nullptr);
+}
+
+void Porter::write(void* buffer, std::size_t size, BufferDeleter deleter, void* context){
+  Item item(buffer, size);
+  item.deleter = deleter;
+  item.context = context;
+  if(!acquire(size, nullptr, 0, Waiter::forever())){
+    // dropped in overwrite mode, it is ours to free anyway
+    deleter(buffer, context);
     return;
   }
-  memcpy(buff, buffer, size);
+  publish(item);
+}
 
-  logs_.push(Item(buff, size));
+void Porter::deleteArray(void* buffer, void*){
+  delete[] static_cast<char*>(buffer);
 }
 
 void Porter::read(void** buffer, std::size_t& size){
+  read(0, buffer, size);
+}
 
+void Porter::read(std::size_t consumer, void** buffer, std::size_t& size){
   Item item(nullptr, 0);
-  logs_.fpop(item);
+  take(consumer, &item, 1, SIZE_MAX, Waiter::forever());
   // get buffer ptr
   *buffer = item.buffer;
-  last_read_ = *buffer;
   // get size
   size = item.size;
-  last_size_ = size;
-  
-  wait_consume_.push(item);
+}
+
+bool Porter::try_read(void** buffer, std::size_t& size){
+  return try_read(0, buffer, size);
+}
+
+bool Porter::try_read(std::size_t consumer, void** buffer, std::size_t& size){
+  return read_for(consumer, buffer, size, std::chrono::milliseconds(0));
+}
+
+bool Porter::read_for(void** buffer, std::size_t& size,
+                      std::chrono::milliseconds timeout){
+  return read_for(0, buffer, size, timeout);
+}
+
+bool Porter::read_for(std::size_t consumer, void** buffer, std::size_t& size,
+                      std::chrono::milliseconds timeout){
+  Item item(nullptr, 0);
+  if(take(consumer, &item, 1, SIZE_MAX, Waiter::deadlineAfter(timeout)) == 0){
+    return false;
+  }
+  *buffer = item.buffer;
+  size = item.size;
+  return true;
+}
+
+std::size_t Porter::readBatch(Item* items, std::size_t max_items,
+                              std::size_t max_bytes){
+  return readBatch(0, items, max_items, max_bytes);
+}
+
+std::size_t Porter::readBatch(std::size_t consumer, Item* items, std::size_t max_items,
+                              std::size_t max_bytes){
+  return take(consumer, items, max_items, max_bytes, Waiter::forever());
+}
+
+// pop up to `max_items` buffers for `consumer`: from its own queue,
+// else from any other, else wait on its own queue. While waiting,
+// look at the others again every `kStealIntervalUs`
+std::size_t Porter::take(std::size_t consumer, Item* items, std::size_t max_items,
+                         std::size_t max_bytes, Waiter::Clock::time_point deadline){
+  assert(consumer < num_consumers_);
+  std::size_t bytes = 0;
+  auto accept = [&](const Item& item) {
+    bytes += item.size;
+    return bytes <= max_bytes;
+  };
+  std::size_t count = 0;
+  if(log_){
+    count = log_->fpop_n(items, max_items, accept, deadline);
+  }else if(num_consumers_ == 1){
+    count = logs_[0]->fpop_n(items, max_items, accept, deadline);
+  }
+  while(num_consumers_ > 1){
+    for(std::size_t i = 0; i < num_consumers_ && count == 0; ++i){
+      count = logs_[(consumer + i) % num_consumers_]->fpop_n(items, max_items, accept,
+                                                             Waiter::noWait());
+    }
+    if(count > 0 || deadline == Waiter::noWait()){
+      break;
+    }
+    Waiter::Clock::time_point slice =
+        Waiter::deadlineAfter(std::chrono::microseconds(kStealIntervalUs));
+    count = logs_[consumer]->fpop_n(items, max_items, accept, std::min(slice, deadline));
+    if(count > 0 || Waiter::Clock::now() >= deadline){
+      break;
+    }
+  }
+  if(spill_fd_ >= 0){
+    for(std::size_t i = 0; i < count; ++i){
+      if(items[i].deleter == unspilled){
+        loadSpilled(items[i]);
+      }
+    }
+  }
+  popped(consumer, items, count);
+  return count;
+}
+
+// remember buffers handed to a consumer until they are consumed
+void Porter::popped(std::size_t consumer, const Item* items, std::size_t count){
+  if(count == 0){
+    return;
+  }
+  Consumer& c = consumers_[consumer];
+  for(std::size_t i = 0; i < count; ++i){
+    c.wait_consume.push_back(items[i]);
+  }
+  c.last_read = items[count - 1].buffer;
+  c.last_size = items[count - 1].size;
 }
 
 void Porter::lastRead(void** buffer, std::size_t& size){
-  if(!last_read_){
+  lastRead(0, buffer, size);
+}
+
+void Porter::lastRead(std::size_t consumer, void** buffer, std::size_t& size){
+  assert(consumer < num_consumers_);
+  Consumer& c = consumers_[consumer];
+  if(!c.last_read){
     std::cerr << "Error: Last Item has been consumed.\n";
   }
-  *buffer = last_read_;
-  size = last_size_;
+  *buffer = c.last_read;
+  size = c.last_size;
 }
 
 void Porter::consume(){
-  Item item = wait_consume_.front();
-  wait_consume_.pop();
-  if(item.buffer == last_read_){
-    last_read_ = nullptr;
-    last_size_ = 0;
+  consumeN(0, 1);
+}
+
+void Porter::consumeN(std::size_t n){
+  consumeN(0, n);
+}
+
+void Porter::consume(std::size_t consumer){
+  consumeN(consumer, 1);
+}
+
+void Porter::consumeN(std::size_t consumer, std::size_t n){
+  assert(consumer < num_consumers_);
+  Consumer& c = consumers_[consumer];
+  std::size_t released = 0;
+  std::size_t i = 0;
+  for(; i < n && !c.wait_consume.empty(); ++i){
+    Item item = c.wait_consume.front();
+    c.wait_consume.pop_front();
+    if(item.buffer == c.last_read){
+      c.last_read = nullptr;
+      c.last_size = 0;
+    }
+    // recycle buffer
+    release(item);
+    released += item.size;
   }
-  // free buffer
-  std::free(item.buffer);
-  // update current size
-  std::lock_guard<std::mutex> lock(size_mtx_);
-  current_size_ -= item.size;
-  not_full_.notify_one();
+  counters_.out(released, i);
+  not_full_.notify();
+}
+
+void Porter::consumeBuffer(const void* buffer){
+  consumeBuffer(0, buffer);
+}
+
+void Porter::consumeBuffer(std::size_t consumer, const void* buffer){
+  assert(consumer < num_consumers_);
+  Consumer& c = consumers_[consumer];
+  // the oldest buffers are the likely ones
+  std::deque<Item>::iterator it = c.wait_consume.begin();
+  while(it != c.wait_consume.end() && it->buffer != buffer){
+    ++it;
+  }
+  if(it == c.wait_consume.end()){
+    std::cerr << "Error: consumed buffer is not held by the consumer\n";
+    return;
+  }
+  Item item = *it;
+  c.wait_consume.erase(it);
+  if(item.buffer == c.last_read){
+    c.last_read = nullptr;
+    c.last_size = 0;
+  }
+  release(item);
+  counters_.out(item.size, 1);
+  not_full_.notify();
 }
 
 bool Porter::resize(std::size_t size){
-  std::lock_guard<std::mutex> lock(size_mtx_);
-  if(size < current_size_){
+  if(size < current_size_.load(std::memory_order_acquire)){
     std::cerr << "Error: Can't resize ringbuffer.\n";
     return false;
   }
-  max_size_ = size;
-  not_full_.notify_one();
+  max_size_.store(size, std::memory_order_release);
+  not_full_.notify();
   return true;
 }
 
+ChannelStats Porter::stats() const {
+  ChannelStats s = counters_.snapshot();
+  // consumers wait in the queues
+  s.wakeups = not_full_.wakeups();
+  std::vector<ChannelStats> queues;
+  if(log_){
+    queues.push_back(log_->stats());
+  }
+  for(const std::unique_ptr<SafeQueue<Item>>& log : logs_){
+    queues.push_back(log->stats());
+  }
+  for(const ChannelStats& queue : queues){
+    s.read_wait_ns += queue.read_wait_ns;
+    s.read_waits += queue.read_waits;
+    for(std::size_t i = 0; i < kStallBuckets; ++i){
+      s.read_wait_hist[i] += queue.read_wait_hist[i];
+    }
+    s.wakeups += queue.wakeups;
+  }
+  return s;
+}
+
 Porter::~Porter(){
   Item item(nullptr, 0);
-  while(!logs_.empty()){
-    logs_.fpop(item);
-    std::free(item.buffer);
+  while(log_ && log_->try_fpop(item)){
+    release(item);
+  }
+  for(const std::unique_ptr<SafeQueue<Item>>& log : logs_){
+    while(log->try_fpop(item)){
+      release(item);
+    }
+  }
+  for(std::size_t i = 0; i < num_consumers_; ++i){
+    while(!consumers_[i].wait_consume.empty()){
+      consume(i);
+    }
+  }
+  if(spill_window_){
+    dropWindow(spill_window_);
+  }
+  if(governor_){
+    // give the cached blocks back before leaving
+    std::size_t freed = pool_.trim();
+    if(freed){
+      uncharge(freed);
+    }
+    governor_->detach(member_);
   }
-  while(!wait_consume_.empty()){
-    consume();
+  if(spill_fd_ >= 0){
+    close(spill_fd_);
   }
 }
 
@@ -1,87 +1,980 @@
 #include <ringbuff.hpp>
 
-RingBuffer::RingBuffer(std::size_t buffer_size)
-    : buffer_size_(buffer_size),
-      ofs_consumer_(0),
-      ofs_reader_(0),
-      ofs_writer_(0),
-      buffer_(nullptr) {
-  assert(buffer_size_ >= 2);
-  buffer_ = static_cast<void*>(std::malloc(buffer_size_));
-  if(!buffer_){
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline std::size_t pageSize(){
+  return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+RingBuffer::RingBuffer(std::size_t buffer_size, const RingOptions& options)
+    : buffer_size_((buffer_size + kRecordAlign - 1) & ~(kRecordAlign - 1)),
+      buffer_(nullptr),
+      mirrored_(false),
+      multi_producer_(options.multi_producer),
+      shared_(!options.shm_name.empty()),
+      overwrite_(options.overwrite),
+      header_size_(options.overwrite ? 2 * sizeof(Header) : sizeof(Header)),
+      align_(options.align),
+      prefix_((header_size_ + options.align - 1) & ~(options.align - 1)),
+      placement_(options.placement),
+      placed_size_(0),
+      num_readers_(options.readers),
+      ctl_(nullptr),
+      consumers_(nullptr),
+      readers_(nullptr),
+      commit_bits_(nullptr),
+      ctl_size_(0),
+      cached_consumer_(0),
+      reserved_(0),
+      next_seq_(0),
+      not_full_(options.wait),
+      not_empty_(options.wait) {
+  if(num_readers_ == 0 || (num_readers_ > 1 && multi_producer_)){
+    throw std::invalid_argument("RingBuffer: broadcast readers need a single producer");
+  }
+  if(align_ < kRecordAlign || (align_ & (align_ - 1)) != 0 || align_ > pageSize()){
+    throw std::invalid_argument("RingBuffer: align must be a power of two from 8 to the page size");
+  }
+  buffer_size_ = (buffer_size_ + align_ - 1) & ~(align_ - 1);
+  if(overwrite_ && (shared_ || num_readers_ > 1 || multi_producer_)){
+    throw std::invalid_argument("RingBuffer: overwrite needs a single producer and reader in one process");
+  }
+  if(options.event_fds){
+    if(shared_ || num_readers_ > 1){
+      throw std::invalid_argument("RingBuffer: event fds need a single reader in one process");
+    }
+    if(not_empty_.enableEvent() < 0 || not_full_.enableEvent() < 0){
+      throw std::runtime_error("RingBuffer: eventfd failed");
+    }
+  }
+  if(shared_){
+    openShared(options);
+    return;
+  }
+  assert(buffer_size_ >= recordSize(0));
+
+  if(options.backend != RingBackend::kMirrored || !mapMirrored(-1, 0)){
+    if(placement_.isDefault()){
+      if(posix_memalign(&buffer_, align_, buffer_size_) != 0){
+        buffer_ = nullptr;
+      }
+    }else{
+      placed_size_ = buffer_size_;
+      buffer_ = placeAlloc(placed_size_, placement_);
+    }
+    if(!buffer_){
+      throw std::bad_alloc();
+    }
+  }
+  void* ctl = nullptr;
+  if(posix_memalign(&ctl, kCacheLine,
+                    controlSize(num_readers_, buffer_size_, multi_producer_)) != 0){
+    releaseBuffer();
     throw std::bad_alloc();
   }
+  initControl(ctl);
 }
 
 RingBuffer::~RingBuffer(){
-  if(buffer_){
+  releaseBuffer();
+  if(shared_){
+    munmap(ctl_, ctl_size_);
+  }else{
+    std::free(ctl_);
+  }
+  delete[] readers_;
+}
+
+void RingBuffer::releaseBuffer(){
+  if(mirrored_){
+    munmap(buffer_, 2 * buffer_size_);
+  }else if(shared_){
+    if(buffer_){
+      munmap(buffer_, buffer_size_);
+    }
+  }else if(placed_size_){
+    placeFree(buffer_, placed_size_);
+  }else{
     std::free(buffer_);
   }
+  buffer_ = nullptr;
+  mirrored_ = false;
+}
+
+ChannelStats RingBuffer::stats() const {
+  ChannelStats s = counters_.snapshot();
+  s.wakeups = not_full_.wakeups() + not_empty_.wakeups();
+  return s;
+}
+
+bool RingBuffer::unlink(const std::string& shm_name){
+  return shm_unlink(shm_name.c_str()) == 0;
+}
+
+std::size_t RingBuffer::controlSize(std::size_t readers, std::size_t buffer_size,
+                                    bool multi_producer){
+  std::size_t size = sizeof(Control) + readers * sizeof(Consumer);
+  if(multi_producer){
+    size += (buffer_size / kRecordAlign + 63) / 64 * sizeof(std::uint64_t);
+  }
+  return size;
+}
+
+void RingBuffer::initControl(void* mem){
+  ctl_ = new (mem) Control();
+  ctl_->buffer_size = buffer_size_;
+  ctl_->readers = num_readers_;
+  ctl_->multi_producer = multi_producer_;
+  ctl_->mirrored = mirrored_;
+  ctl_->align = align_;
+  ctl_->ofs_writer.store(0, std::memory_order_relaxed);
+  ctl_->ofs_read.store(0, std::memory_order_relaxed);
+  ctl_->dropped.store(0, std::memory_order_relaxed);
+  ctl_->not_full.init();
+  ctl_->not_empty.init();
+
+  char* next = reinterpret_cast<char*>(ctl_ + 1);
+  consumers_ = new (next) Consumer[num_readers_];
+  for(std::size_t i = 0; i < num_readers_; ++i){
+    consumers_[i].ofs.store(0, std::memory_order_relaxed);
+  }
+  next += num_readers_ * sizeof(Consumer);
+
+  if(multi_producer_){
+    std::size_t words = (buffer_size_ / kRecordAlign + 63) / 64;
+    commit_bits_ = new (next) std::atomic<std::uint64_t>[words];
+    for(std::size_t i = 0; i < words; ++i){
+      commit_bits_[i].store(0, std::memory_order_relaxed);
+    }
+  }
+  ctl_->magic.store(kShmMagic, std::memory_order_release);
+  attachWaiters();
+  attachReaders();
+}
+
+void RingBuffer::attachWaiters(){
+  not_full_.attach(&ctl_->not_full, shared_);
+  not_empty_.attach(&ctl_->not_empty, shared_);
+}
+
+void RingBuffer::attachControl(void* mem){
+  ctl_ = static_cast<Control*>(mem);
+  char* next = reinterpret_cast<char*>(ctl_ + 1);
+  consumers_ = reinterpret_cast<Consumer*>(next);
+  next += num_readers_ * sizeof(Consumer);
+  if(multi_producer_){
+    commit_bits_ = reinterpret_cast<std::atomic<std::uint64_t>*>(next);
+  }
+  attachWaiters();
+  attachReaders();
+}
+
+void RingBuffer::attachReaders(){
+  // reading starts at the consume cursor, so anything read but
+  // not consumed before a restart is read again
+  readers_ = new Reader[num_readers_];
+  for(std::size_t i = 0; i < num_readers_; ++i){
+    readers_[i].ofs_consumer = &consumers_[i].ofs;
+    readers_[i].ofs_reader = consumers_[i].ofs.load(std::memory_order_acquire);
+    readers_[i].ofs_held = readers_[i].ofs_reader;
+    readers_[i].cached_writer = readers_[i].ofs_reader;
+    readers_[i].drained = 0;
+  }
+}
+
+// map `size` bytes of `fd` at `offset` twice back to back, at an
+// address aligned to `align`. Return nullptr on failure
+static char* mapTwice(int fd, std::size_t offset, std::size_t size, std::size_t align){
+  std::size_t slack = align - pageSize();
+  // reserve 2x address space, then map the file over both halves
+  char* area = static_cast<char*>(mmap(nullptr, 2 * size + slack, PROT_NONE,
+                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if(area == MAP_FAILED){
+    return nullptr;
+  }
+  char* base = reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(area) + align - 1)
+                                       / align * align);
+  if(base != area){
+    munmap(area, base - area);
+  }
+  if(area + slack != base){
+    munmap(base + 2 * size, area + slack - base);
+  }
+  for(int half = 0; half < 2; ++half){
+    void* addr = mmap(base + half * size, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, offset);
+    if(addr == MAP_FAILED){
+      munmap(base, 2 * size);
+      return nullptr;
+    }
+  }
+  return base;
+}
+
+bool RingBuffer::mapMirrored(int fd, std::size_t offset){
+  std::size_t page = pageSize();
+  std::size_t size = (buffer_size_ + page - 1) / page * page;
+  char* base = nullptr;
+
+  if(fd >= 0){
+    base = mapTwice(fd, offset, size, page);
+  }else{
+    if(placement_.huge_pages == HugePages::kExplicit){
+      std::size_t huge_size = (buffer_size_ + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+      int huge_fd = memfd_create("ringbuff", MFD_CLOEXEC | MFD_HUGETLB);
+      if(huge_fd >= 0 && ftruncate(huge_fd, huge_size) == 0){
+        base = mapTwice(huge_fd, 0, huge_size, kHugePageSize);
+        size = huge_size;
+      }
+      if(huge_fd >= 0){
+        close(huge_fd);
+      }
+      if(!base){
+        std::cerr << "Warning: no explicit huge page available, use transparent huge page" << std::endl;
+        size = (buffer_size_ + page - 1) / page * page;
+      }
+    }
+    if(!base){
+      int own_fd = memfd_create("ringbuff", MFD_CLOEXEC);
+      if(own_fd < 0){
+        std::cerr << "Warning: memfd_create failed, use malloc buffer" << std::endl;
+        return false;
+      }
+      if(ftruncate(own_fd, size) == 0){
+        base = mapTwice(own_fd, 0, size, page);
+      }
+      // mappings keep the memory alive
+      close(own_fd);
+    }
+  }
+  if(!base){
+    std::cerr << "Warning: mmap failed, use malloc buffer" << std::endl;
+    return false;
+  }
+
+  buffer_ = static_cast<void*>(base);
+  buffer_size_ = size;
+  mirrored_ = true;
+  if(fd < 0){
+    placeApply(buffer_, buffer_size_, placement_);
+  }
+  return true;
+}
+
+void RingBuffer::openShared(const RingOptions& options){
+  const char* name = options.shm_name.c_str();
+  bool creator = true;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0 && errno == EEXIST){
+    creator = false;
+    fd = shm_open(name, O_RDWR, 0600);
+  }
+  if(fd < 0){
+    throw std::runtime_error("RingBuffer: shm_open failed for " + options.shm_name);
+  }
+
+  std::size_t page = pageSize();
+  if(creator){
+    assert(buffer_size_ >= recordSize(0));
+    if(options.backend == RingBackend::kMirrored){
+      buffer_size_ = (buffer_size_ + page - 1) / page * page;
+    }
+    ctl_size_ = controlSize(num_readers_, buffer_size_, multi_producer_);
+    ctl_size_ = (ctl_size_ + page - 1) / page * page;
+    if(ftruncate(fd, ctl_size_ + buffer_size_) != 0){
+      close(fd);
+      shm_unlink(name);
+      throw std::runtime_error("RingBuffer: ftruncate failed for " + options.shm_name);
+    }
+  }else{
+    // wait for the creator to size the segment and publish its
+    // layout, but not for one that died or isn't a ring at all
+    Waiter::Clock::time_point deadline =
+        Waiter::Clock::now() + std::chrono::milliseconds(kShmAttachMs);
+    struct stat st;
+    while(fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) < sizeof(Control)){
+      if(Waiter::Clock::now() >= deadline){
+        close(fd);
+        throw std::runtime_error("RingBuffer: no ring in " + options.shm_name);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    Control* probe = static_cast<Control*>(mmap(nullptr, sizeof(Control), PROT_READ,
+                                                MAP_SHARED, fd, 0));
+    if(probe == MAP_FAILED){
+      close(fd);
+      throw std::runtime_error("RingBuffer: mmap failed for " + options.shm_name);
+    }
+    std::uint64_t magic = probe->magic.load(std::memory_order_acquire);
+    while(magic != kShmMagic){
+      if(magic != 0 || Waiter::Clock::now() >= deadline){
+        munmap(probe, sizeof(Control));
+        close(fd);
+        throw std::runtime_error("RingBuffer: no ring of this layout in " + options.shm_name);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      magic = probe->magic.load(std::memory_order_acquire);
+    }
+    buffer_size_ = probe->buffer_size;
+    num_readers_ = probe->readers;
+    multi_producer_ = probe->multi_producer != 0;
+    bool mirrored = probe->mirrored != 0;
+    align_ = probe->align;
+    prefix_ = (header_size_ + align_ - 1) & ~(align_ - 1);
+    munmap(probe, sizeof(Control));
+    ctl_size_ = controlSize(num_readers_, buffer_size_, multi_producer_);
+    ctl_size_ = (ctl_size_ + page - 1) / page * page;
+    if(fstat(fd, &st) != 0 || num_readers_ == 0 || buffer_size_ == 0 ||
+       static_cast<std::size_t>(st.st_size) < ctl_size_ + buffer_size_){
+      close(fd);
+      throw std::runtime_error("RingBuffer: size mismatch in " + options.shm_name);
+    }
+    if(mirrored && !mapMirrored(fd, ctl_size_)){
+      close(fd);
+      throw std::runtime_error("RingBuffer: can't map mirrored " + options.shm_name);
+    }
+  }
+
+  void* ctl = mmap(nullptr, ctl_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(ctl == MAP_FAILED){
+    releaseBuffer();
+    close(fd);
+    throw std::runtime_error("RingBuffer: mmap failed for " + options.shm_name);
+  }
+  if(creator && options.backend == RingBackend::kMirrored){
+    mapMirrored(fd, ctl_size_);
+  }
+  if(!buffer_){
+    buffer_ = mmap(nullptr, buffer_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, ctl_size_);
+    if(buffer_ == MAP_FAILED){
+      buffer_ = nullptr;
+      munmap(ctl, ctl_size_);
+      close(fd);
+      throw std::runtime_error("RingBuffer: mmap failed for " + options.shm_name);
+    }
+  }
+  close(fd);
+
+  if(creator){
+    if(!mirrored_){
+      placeApply(buffer_, buffer_size_, placement_);
+    }
+    initControl(ctl);
+  }else{
+    attachControl(ctl);
+  }
+}
+
+void RingBuffer::setCommitted(std::size_t ofs){
+  std::size_t slot = ofs % buffer_size_ / kRecordAlign;
+  commit_bits_[slot / 64].fetch_or(1ULL << (slot % 64), std::memory_order_release);
+}
+
+bool RingBuffer::committed(std::size_t ofs) const {
+  std::size_t slot = ofs % buffer_size_ / kRecordAlign;
+  return commit_bits_[slot / 64].load(std::memory_order_acquire) & (1ULL << (slot % 64));
+}
+
+void RingBuffer::clearCommitted(std::size_t ofs){
+  std::size_t slot = ofs % buffer_size_ / kRecordAlign;
+  commit_bits_[slot / 64].fetch_and(~(1ULL << (slot % 64)), std::memory_order_relaxed);
+}
+
+bool RingBuffer::ready(Reader& r){
+  if(multi_producer_){
+    // the bit of a record held a whole lap back is still set
+    return r.ofs_reader - r.ofs_held < buffer_size_ && committed(r.ofs_reader);
+  }
+  if(r.cached_writer == r.ofs_reader){
+    r.cached_writer = ctl_->ofs_writer.load(std::memory_order_acquire);
+    // the producer moves the consumer cursor too in overwrite mode
+    std::size_t consumer = r.ofs_consumer->load(std::memory_order_relaxed);
+    if(r.cached_writer > consumer){
+      counters_.occupancy(r.cached_writer - consumer);
+    }
+  }
+  return r.cached_writer != r.ofs_reader;
+}
+
+std::size_t RingBuffer::slowestConsumer() const {
+  std::size_t consumer = consumers_[0].ofs.load(std::memory_order_acquire);
+  for(std::size_t i = 1; i < num_readers_; ++i){
+    std::size_t ofs = consumers_[i].ofs.load(std::memory_order_acquire);
+    if(ofs < consumer){
+      consumer = ofs;
+    }
+  }
+  return consumer;
+}
+
+bool RingBuffer::waitSpace(std::size_t writer, std::size_t size,
+                           Waiter::Clock::time_point deadline){
+  if(!multi_producer_ && writer + size <= cached_consumer_ + buffer_size_){
+    return true;
+  }
+  // with several producers `writer` may be stale and already behind
+  // the consumer, written so that it doesn't underflow
+  std::size_t consumer = slowestConsumer();
+  bool ok = writer + size <= consumer + buffer_size_;
+  if(!ok){
+    StallTimer stall(counters_, true, deadline != Waiter::noWait());
+    ok = not_full_.waitUntil([&] {
+      consumer = slowestConsumer();
+      return writer + size <= consumer + buffer_size_;
+    }, deadline);
+  }
+  if(writer > consumer){
+    counters_.occupancy(writer - consumer);
+  }
+  if(!multi_producer_){
+    cached_consumer_ = consumer;
+  }
+  return ok;
+}
+
+bool RingBuffer::waitData(Reader& r, Waiter::Clock::time_point deadline){
+  StallTimer stall(counters_, false, deadline != Waiter::noWait());
+  return not_empty_.waitUntil([&] { return ready(r); }, deadline);
+}
+
+// overwrite mode: drop the oldest unread records until `size` bytes
+// fit at `writer`. False if records the reader still holds are in
+// the way, then the new record is dropped
+bool RingBuffer::makeSpace(std::size_t writer, std::size_t size){
+  while(true){
+    std::size_t consumer = consumers_[0].ofs.load(std::memory_order_acquire);
+    if(writer + size <= consumer + buffer_size_){
+      cached_consumer_ = consumer;
+      return true;
+    }
+    std::size_t oldest = ctl_->ofs_read.load(std::memory_order_acquire);
+    if(oldest != consumer || oldest == writer){
+      ctl_->dropped.fetch_add(1, std::memory_order_relaxed);
+      ++next_seq_;
+      return false;
+    }
+    Header header = *headerAt(oldest);
+    bool padding = header & kPaddingFlag;
+    std::size_t len = padding ? static_cast<std::size_t>(header & ~kPaddingFlag)
+                              : recordSize(static_cast<std::size_t>(header));
+    // fails if the reader claimed it first
+    if(ctl_->ofs_read.compare_exchange_strong(oldest, oldest + len,
+                                              std::memory_order_acq_rel)){
+      consumers_[0].ofs.fetch_add(len, std::memory_order_release);
+      if(!padding){
+        ctl_->dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+// overwrite mode: take the record of `len` bytes at the read cursor
+// before the producer can drop it. If it was dropped, move on to the
+// oldest record left
+bool RingBuffer::claimRead(Reader& r, std::size_t len){
+  std::size_t expected = r.ofs_reader;
+  if(ctl_->ofs_read.compare_exchange_strong(expected, expected + len,
+                                            std::memory_order_acq_rel)){
+    return true;
+  }
+  // records are only dropped while the reader holds none
+  r.ofs_reader = expected;
+  r.ofs_held = expected;
+  r.cached_writer = expected;
+  return false;
+}
+
+void RingBuffer::publishWriter(std::size_t ofs){
+  ctl_->ofs_writer.store(ofs, std::memory_order_release);
+  notifyReader();
+}
+
+void RingBuffer::notifyReader(){
+  not_empty_.notify(num_readers_ > 1);
+}
+
+void RingBuffer::publishConsumer(Reader& r, std::size_t ofs){
+  if(multi_producer_){
+    // commit bits stay set until the records are released, so a
+    // restarted consumer finds the ones it read again. Cleared
+    // before producers may reuse the space
+    for(std::size_t held = r.ofs_held; held != ofs;){
+      Header header = *headerAt(held);
+      clearCommitted(held);
+      held += header & kPaddingFlag ? static_cast<std::size_t>(header & ~kPaddingFlag)
+                                    : recordSize(static_cast<std::size_t>(header));
+    }
+  }
+  if(overwrite_){
+    // the producer advances it too when it drops records
+    r.ofs_consumer->fetch_add(ofs - r.ofs_held, std::memory_order_release);
+  }else{
+    r.ofs_consumer->store(ofs, std::memory_order_release);
+  }
+  r.ofs_held = ofs;
+  // producers may wait for different amounts of space
+  not_full_.notify(multi_producer_);
 }
 
 void RingBuffer::write(const void* buffer, std::size_t size){
-  if(size > buffer_size_){
+  writeUntil(buffer, size, Waiter::forever());
+}
+
+ssize_t RingBuffer::fillFromFd(int fd, std::size_t max){
+  if(multi_producer_ || overwrite_){
+    std::cerr << "Error: fillFromFd needs a single producer without overwrite" << std::endl;
+    errno = EINVAL;
+    return -1;
+  }
+  if(max == 0){
+    return 0;
+  }
+  std::size_t min_len = recordSize(1);
+  if(min_len > buffer_size_){
     std::cerr << "Error: buffer size too large" << std::endl;
+    errno = EINVAL;
+    return -1;
+  }
+  std::size_t writer = ctl_->ofs_writer.load(std::memory_order_relaxed);
+  std::size_t remain = buffer_size_ - writer % buffer_size_;
+  if(remain < min_len && !mirrored_){
+    waitSpace(writer, remain, Waiter::forever());
+    *headerAt(writer) = kPaddingFlag | remain;
+    counters_.padding(remain);
+    writer += remain;
+    publishWriter(writer);
+    remain = buffer_size_;
+  }
+  waitSpace(writer, min_len, Waiter::forever());
+  // take all the space free right now, not just what we waited for
+  cached_consumer_ = slowestConsumer();
+  std::size_t free = cached_consumer_ + buffer_size_ - writer;
+
+  // one record up to the end of the buffer, and a second one from
+  // its head if the first fills the tail and space is left there
+  struct iovec iov[2];
+  int count = 1;
+  std::size_t first = std::min((mirrored_ ? free : std::min(free, remain)) - prefix_, max);
+  iov[0].iov_base = payloadAt(writer);
+  iov[0].iov_len = first;
+  if(!mirrored_ && first == remain - prefix_ && first < max && free >= remain + min_len){
+    iov[1].iov_base = payloadAt(writer + remain);
+    iov[1].iov_len = std::min(free - remain - prefix_, max - first);
+    count = 2;
+  }
+  ssize_t n = readv(fd, iov, count);
+  if(n <= 0){
+    return n;
+  }
+  std::size_t got = static_cast<std::size_t>(n);
+  std::size_t size = std::min(got, first);
+  *headerAt(writer) = size;
+  writer += recordSize(size);
+  if(got > first){
+    *headerAt(writer) = got - first;
+    writer += recordSize(got - first);
+  }
+  counters_.in(got, got > first ? 2 : 1);
+  publishWriter(writer);
+  return n;
+}
+
+ssize_t RingBuffer::drainToFd(int fd){
+  return drainToFd(0, fd);
+}
+
+ssize_t RingBuffer::drainToFd(std::size_t reader, int fd){
+  assert(reader < num_readers_);
+  Reader& r = readers_[reader];
+  struct iovec iov[kDrainRecords];
+  std::size_t count = 0;
+  // records held since a short write go first
+  for(std::size_t ofs = r.ofs_held; ofs != r.ofs_reader && count < kDrainRecords;){
+    Header header = *headerAt(ofs);
+    if(header & kPaddingFlag){
+      ofs += static_cast<std::size_t>(header & ~kPaddingFlag);
+      continue;
+    }
+    iov[count].iov_base = payloadAt(ofs);
+    iov[count].iov_len = static_cast<std::size_t>(header);
+    ofs += recordSize(iov[count].iov_len);
+    ++count;
+  }
+  if(count < kDrainRecords){
+    RingRecord records[kDrainRecords];
+    std::size_t more = readBatchUntil(reader, records, kDrainRecords - count, SIZE_MAX,
+                                      count ? Waiter::noWait() : Waiter::forever());
+    for(std::size_t i = 0; i < more; ++i, ++count){
+      iov[count].iov_base = records[i].buffer;
+      iov[count].iov_len = records[i].size;
+    }
+  }
+  iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + r.drained;
+  iov[0].iov_len -= r.drained;
+
+  ssize_t n = ::writev(fd, iov, count);
+  if(n < 0){
+    return n;
+  }
+  std::size_t left = static_cast<std::size_t>(n);
+  std::size_t done = 0;
+  while(done < count && iov[done].iov_len <= left){
+    left -= iov[done].iov_len;
+    ++done;
+  }
+  r.drained = done == 0 ? r.drained + left : left;
+  if(done > 0){
+    consumeN(reader, done);
+  }
+  return n;
+}
+
+bool RingBuffer::try_write(const void* buffer, std::size_t size){
+  return writeUntil(buffer, size, Waiter::noWait());
+}
+
+bool RingBuffer::write_for(const void* buffer, std::size_t size,
+                           std::chrono::milliseconds timeout){
+  return writeUntil(buffer, size, Waiter::deadlineAfter(timeout));
+}
+
+bool RingBuffer::writeUntil(const void* buffer, std::size_t size,
+                            Waiter::Clock::time_point deadline){
+  void* slot = reserveUntil(size, deadline);
+  if(!slot){
+    return false;
+  }
+  memcpy(slot, buffer, size);
+  commit(slot, size);
+  return true;
+}
+
+void RingBuffer::writev(const struct iovec* iov, std::size_t count){
+  std::size_t size = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    size += iov[i].iov_len;
+  }
+  char* slot = static_cast<char*>(reserve(size));
+  if(!slot){
     return;
   }
+  std::size_t ofs = 0;
+  for(std::size_t i = 0; i < count; ++i){
+    memcpy(slot + ofs, iov[i].iov_base, iov[i].iov_len);
+    ofs += iov[i].iov_len;
+  }
+  commit(slot, size);
+}
+
+std::size_t RingBuffer::claim(std::size_t len, Waiter::Clock::time_point deadline){
+  std::size_t writer = ctl_->ofs_writer.load(std::memory_order_relaxed);
+  while(true){
+    std::size_t remain = buffer_size_ - writer % buffer_size_;
+    bool wrap = remain < len && !mirrored_;
+    std::size_t need = wrap ? remain : len;
+    if(!waitSpace(writer, need, deadline)){
+      return SIZE_MAX;
+    }
+    // on failure `writer` is reloaded with the latest claim
+    if(!ctl_->ofs_writer.compare_exchange_weak(writer, writer + need,
+                                          std::memory_order_relaxed)){
+      continue;
+    }
+    if(!wrap){
+      return writer;
+    }
+    // we own the tail of the buffer: publish it as padding
+    // and claim again from the head
+    *headerAt(writer) = kPaddingFlag | remain;
+    counters_.padding(remain);
+    setCommitted(writer);
+    notifyReader();
+    writer += remain;
+  }
+}
+
+void* RingBuffer::reserve(std::size_t size){
+  return reserveUntil(size, Waiter::forever());
+}
+
+void* RingBuffer::reserveUntil(std::size_t size, Waiter::Clock::time_point deadline){
+  std::size_t len = recordSize(size);
+  if(len > buffer_size_){
+    std::cerr << "Error: buffer size too large" << std::endl;
+    return nullptr;
+  }
+
+  if(multi_producer_){
+    std::size_t writer = claim(len, deadline);
+    if(writer == SIZE_MAX){
+      return nullptr;
+    }
+    // keep the claimed length in the header until commit
+    *headerAt(writer) = len;
+    return payloadAt(writer);
+  }
+
+  std::size_t writer = ctl_->ofs_writer.load(std::memory_order_relaxed);
+  std::size_t remain = buffer_size_ - writer % buffer_size_;
+  if(remain < len && !mirrored_){
+    // record can't be continous: fill the tail with a padding
+    // record and publish it first, so the consumer can release
+    // it while we wait for space at the head of the buffer
+    if(overwrite_ ? !makeSpace(writer, remain) : !waitSpace(writer, remain, deadline)){
+      return nullptr;
+    }
+    *headerAt(writer) = kPaddingFlag | remain;
+    counters_.padding(remain);
+    writer += remain;
+    publishWriter(writer);
+  }
 
-  std::unique_lock<std::mutex> lock(mtx_);
-  while(ofs_writer_ + size - ofs_consumer_ > buffer_size_){
-    // full
-    not_full_.wait(lock);
+  if(overwrite_ ? !makeSpace(writer, len) : !waitSpace(writer, len, deadline)){
+    return nullptr;
   }
-  lock.unlock();
+  reserved_ = len;
+  return payloadAt(writer);
+}
+
+void RingBuffer::commit(std::size_t size){
+  if(multi_producer_){
+    std::cerr << "Error: use commit(slot, size) with multiple producers" << std::endl;
+    return;
+  }
+  std::size_t len = recordSize(size);
+  if(len > reserved_){
+    std::cerr << "Error: commit size larger than reserved size" << std::endl;
+    return;
+  }
+  std::size_t writer = ctl_->ofs_writer.load(std::memory_order_relaxed);
+  *headerAt(writer) = size;
+  if(overwrite_){
+    headerAt(writer)[1] = next_seq_++;
+  }
+  counters_.in(size);
+  reserved_ = 0;
+  publishWriter(writer + len);
+}
 
-  std::size_t real_ofs = ofs_writer_ % buffer_size_;
-  std::size_t remain = buffer_size_ - real_ofs;
-  if(remain <= size){
-    ofs_writer_ += remain;
-    real_ofs = 0;
-    wait_read_.push(remain);
+void RingBuffer::commit(void* slot, std::size_t size){
+  if(!multi_producer_){
+    commit(size);
+    return;
+  }
+  Header* header = reinterpret_cast<Header*>(static_cast<char*>(slot) - header_size_);
+  std::size_t ofs = static_cast<char*>(slot) - prefix_ - (char*)buffer_;
+  std::size_t len = static_cast<std::size_t>(*header);
+  std::size_t used = recordSize(size);
+  if(used > len){
+    // the claimed space has to be published anyway, or the
+    // consumer would wait on it forever
+    std::cerr << "Error: commit size larger than reserved size" << std::endl;
+    *header = kPaddingFlag | len;
+    setCommitted(ofs);
+    notifyReader();
+    return;
+  }
+  if(used < len){
+    // give back the unused tail of the claim as padding
+    *headerAt(ofs + used) = kPaddingFlag | (len - used);
+    setCommitted(ofs + used);
   }
-  ofs_writer_ += size;
-  memcpy((void*)((char*)buffer_ + real_ofs), buffer, size);
-  wait_read_.push(size);
+  *header = size;
+  counters_.in(size);
+  setCommitted(ofs);
+  notifyReader();
 }
 
 void RingBuffer::read(void** buffer, std::size_t& size){
-  
-  wait_read_.fpop(size);
-  ofs_reader_ = ofs_reader_ % buffer_size_;
+  read(0, buffer, size);
+}
+
+void RingBuffer::read(std::size_t reader, void** buffer, std::size_t& size){
+  readUntil(reader, buffer, size, Waiter::forever());
+}
+
+bool RingBuffer::try_read(void** buffer, std::size_t& size){
+  return readUntil(0, buffer, size, Waiter::noWait());
+}
+
+bool RingBuffer::try_read(std::size_t reader, void** buffer, std::size_t& size){
+  return readUntil(reader, buffer, size, Waiter::noWait());
+}
 
-  if(ofs_reader_ + size == buffer_size_){
-    // detect empty buffer
-    ofs_reader_ = 0;
+bool RingBuffer::read_for(void** buffer, std::size_t& size,
+                          std::chrono::milliseconds timeout){
+  return readUntil(0, buffer, size, Waiter::deadlineAfter(timeout));
+}
 
-    std::unique_lock<std::mutex> lock(mtx_);
-    ofs_consumer_ += size;
-    lock.unlock();
+bool RingBuffer::read_for(std::size_t reader, void** buffer, std::size_t& size,
+                          std::chrono::milliseconds timeout){
+  return readUntil(reader, buffer, size, Waiter::deadlineAfter(timeout));
+}
 
-    not_full_.notify_one();
-    wait_read_.fpop(size);
+bool RingBuffer::readUntil(std::size_t reader, void** buffer, std::size_t& size,
+                           Waiter::Clock::time_point deadline){
+  RingRecord record;
+  if(readBatchUntil(reader, &record, 1, SIZE_MAX, deadline) == 0){
+    return false;
   }
+  *buffer = record.buffer;
+  size = record.size;
+  return true;
+}
+
+std::size_t RingBuffer::readBatch(RingRecord* records, std::size_t max_records,
+                                  std::size_t max_bytes){
+  return readBatch(0, records, max_records, max_bytes);
+}
 
-  // if buffer is continous, return the buffer address
-  *buffer = (void*)((char*)buffer_ + ofs_reader_);
-  
-  // update
-  wait_consume_.push(size);
-  ofs_reader_ += size;
+std::size_t RingBuffer::readBatch(std::size_t reader, RingRecord* records,
+                                  std::size_t max_records, std::size_t max_bytes){
+  return readBatchUntil(reader, records, max_records, max_bytes, Waiter::forever());
+}
+
+std::size_t RingBuffer::readBatchUntil(std::size_t reader, RingRecord* records,
+                                       std::size_t max_records, std::size_t max_bytes,
+                                       Waiter::Clock::time_point deadline){
+  assert(reader < num_readers_);
+  Reader& r = readers_[reader];
+  std::size_t count = 0;
+  std::size_t bytes = 0;
+  while(count < max_records){
+    if(!ready(r)){
+      if(count > 0 || !waitData(r, deadline)){
+        break;
+      }
+    }
+    Header header = *headerAt(r.ofs_reader);
+    if(header & kPaddingFlag){
+      // skip the padding. If every earlier record has been
+      // consumed it can be released right away
+      std::size_t pad = static_cast<std::size_t>(header & ~kPaddingFlag);
+      if(overwrite_ && !claimRead(r, pad)){
+        continue;
+      }
+      bool idle = r.ofs_held == r.ofs_reader;
+      r.ofs_reader += pad;
+      if(idle){
+        publishConsumer(r, r.ofs_reader);
+      }
+      continue;
+    }
+    std::size_t size = static_cast<std::size_t>(header);
+    if(count > 0 && bytes + size > max_bytes){
+      break;
+    }
+    records[count].seq = 0;
+    if(overwrite_){
+      if(!claimRead(r, recordSize(size))){
+        continue;
+      }
+      records[count].seq = headerAt(r.ofs_reader)[1];
+    }
+    records[count].buffer = payloadAt(r.ofs_reader);
+    records[count].size = size;
+    r.ofs_reader += recordSize(size);
+    bytes += size;
+    ++count;
+  }
+  return count;
 }
 
 void RingBuffer::consume() {
+  consumeN(0, 1);
+}
+
+void RingBuffer::consumeN(std::size_t n) {
+  consumeN(0, n);
+}
+
+void RingBuffer::consume(std::size_t reader) {
+  consumeN(reader, 1);
+}
+
+void RingBuffer::consumeN(std::size_t reader, std::size_t n) {
   // consume can only be called after `read`
   // `consume` and `read` shoule be called same times.
-  if(wait_consume_.empty()){
-    std::cerr << "Error: consume call and read call number should match" << std::endl;
-    return;
+  assert(reader < num_readers_);
+  Reader& r = readers_[reader];
+  std::size_t consumer = r.ofs_held;
+  std::size_t start = consumer;
+  std::size_t bytes = 0;
+  std::size_t i = 0;
+  for(; i < n; ++i){
+    if(consumer == r.ofs_reader){
+      std::cerr << "Error: consume call and read call number should match" << std::endl;
+      break;
+    }
+    std::size_t size = static_cast<std::size_t>(*headerAt(consumer));
+    consumer += recordSize(size);
+    bytes += size;
+
+    // release padding records the reader has already skipped and
+    // records consumed out of order
+    while(consumer != r.ofs_reader){
+      Header header = *headerAt(consumer);
+      if(header & kPaddingFlag){
+        consumer += header & ~kPaddingFlag;
+      }else if(takeDone(r, consumer)){
+        consumer += recordSize(static_cast<std::size_t>(header));
+      }else{
+        break;
+      }
+    }
+  }
+  if(consumer != start){
+    publishConsumer(r, consumer);
   }
-  std::size_t size = wait_consume_.front();
+  counters_.out(bytes, i);
+}
 
-  std::unique_lock<std::mutex> lock(mtx_);
-  ofs_consumer_ += size;
-  not_full_.notify_one();
-  lock.unlock();
+void RingBuffer::consumeBuffer(const void* buffer) {
+  consumeBuffer(0, buffer);
+}
 
-  wait_consume_.pop();
-}
\ No newline at end of file
+void RingBuffer::consumeBuffer(std::size_t reader, const void* buffer) {
+  assert(reader < num_readers_);
+  Reader& r = readers_[reader];
+  // the payload lies in the first mapping, held records span less
+  // than the buffer, so its offset from `ofs_held` is unique
+  std::size_t pos = static_cast<const char*>(buffer) - (char*)buffer_ - prefix_;
+  std::size_t ofs = r.ofs_held + (pos + buffer_size_ - r.ofs_held % buffer_size_) % buffer_size_;
+  if(ofs - r.ofs_held >= r.ofs_reader - r.ofs_held){
+    std::cerr << "Error: consumed buffer is not held by the reader" << std::endl;
+    return;
+  }
+  if(ofs == r.ofs_held){
+    consumeN(reader, 1);
+    return;
+  }
+  for(std::size_t held : r.done){
+    if(held == ofs){
+      std::cerr << "Error: buffer consumed twice" << std::endl;
+      return;
+    }
+  }
+  // released once every record in front of it is consumed
+  r.done.push_back(ofs);
+  counters_.out(static_cast<std::size_t>(*headerAt(ofs)), 1);
+}
+
+// forget `ofs` if it was consumed out of order
+bool RingBuffer::takeDone(Reader& r, std::size_t ofs){
+  for(std::size_t i = 0; i < r.done.size(); ++i){
+    if(r.done[i] == ofs){
+      r.done[i] = r.done.back();
+      r.done.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
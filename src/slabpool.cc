@@ -0,0 +1,123 @@
+#include <slabpool.hpp>
+
+#include <cstdlib>
+
+static const std::size_t kMinShift = 6;
+
+SlabPool::SlabPool(const MemPlacement& placement)
+    : placement_(placement) {
+  static_assert(SlabPool::kMinBlock == 1 << kMinShift, "SlabPool: kMinShift mismatch");
+  for(std::size_t i = 0; i < kClasses; ++i){
+    free_[i] = nullptr;
+    returned_[i].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+SlabPool::~SlabPool(){
+  trim();
+}
+
+// class 0 is `kMinBlock`, then 4 classes per power of two:
+// 2^k * 1.25, 1.5, 1.75, 2
+std::size_t SlabPool::classOf(std::size_t size){
+  if(size <= kMinBlock){
+    return 0;
+  }
+  std::size_t s = size - 1;
+  std::size_t k = 63 - __builtin_clzll(s);
+  return (k - kMinShift) * 4 + ((s >> (k - 2)) & 3) + 1;
+}
+
+std::size_t SlabPool::classSize(std::size_t cls){
+  if(cls == 0){
+    return kMinBlock;
+  }
+  std::size_t k = (cls - 1) / 4 + kMinShift;
+  return (std::size_t(1) << k) + ((cls - 1) % 4 + 1) * (std::size_t(1) << (k - 2));
+}
+
+std::size_t SlabPool::blockSize(std::size_t size){
+  return size > kMaxBlock ? size : classSize(classOf(size));
+}
+
+void* SlabPool::take(std::size_t size){
+  if(size > kMaxBlock){
+    return nullptr;
+  }
+  std::size_t cls = classOf(size);
+  Node* node = free_[cls];
+  if(!node){
+    node = returned_[cls].exchange(nullptr, std::memory_order_acquire);
+    if(!node){
+      return nullptr;
+    }
+  }
+  free_[cls] = node->next;
+  return node;
+}
+
+void* SlabPool::allocate(std::size_t size){
+  return systemAlloc(blockSize(size));
+}
+
+std::size_t SlabPool::give(void* block, std::size_t size){
+  if(size > kMaxBlock){
+    systemFree(block, size);
+    return size;
+  }
+  std::atomic<Node*>& head = returned_[classOf(size)];
+  Node* node = static_cast<Node*>(block);
+  node->next = head.load(std::memory_order_relaxed);
+  // push only: a stale head can't be reinserted, so no ABA
+  while(!head.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                    std::memory_order_relaxed)){
+  }
+  return 0;
+}
+
+std::size_t SlabPool::discard(void* block, std::size_t size){
+  std::size_t bytes = blockSize(size);
+  systemFree(block, bytes);
+  return bytes;
+}
+
+std::size_t SlabPool::trim(){
+  std::size_t freed = 0;
+  for(std::size_t cls = 0; cls < kClasses; ++cls){
+    std::size_t bytes = classSize(cls);
+    for(int list = 0; list < 2; ++list){
+      Node* node = list == 0 ? free_[cls]
+                             : returned_[cls].exchange(nullptr, std::memory_order_acquire);
+      while(node){
+        Node* next = node->next;
+        systemFree(node, bytes);
+        freed += bytes;
+        node = next;
+      }
+    }
+    free_[cls] = nullptr;
+  }
+  return freed;
+}
+
+void* SlabPool::systemAlloc(std::size_t bytes){
+  if(placement_.isDefault() || bytes < kPlacedMinSize){
+    return std::malloc(bytes);
+  }
+  std::size_t mapped = bytes + kPlacedHeader;
+  char* base = static_cast<char*>(placeAlloc(mapped, placement_));
+  if(base == nullptr){
+    return nullptr;
+  }
+  *reinterpret_cast<std::size_t*>(base) = mapped;
+  return base + kPlacedHeader;
+}
+
+void SlabPool::systemFree(void* block, std::size_t bytes){
+  if(placement_.isDefault() || bytes < kPlacedMinSize){
+    std::free(block);
+    return;
+  }
+  char* base = static_cast<char*>(block) - kPlacedHeader;
+  placeFree(base, *reinterpret_cast<std::size_t*>(base));
+}
@@ -0,0 +1,56 @@
+#include <waitstrategy.hpp>
+
+#include <climits>
+#include <ctime>
+#include <iostream>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// not FUTEX_PRIVATE_FLAG: the word may be in shared memory
+void futexWait(std::atomic<std::uint32_t>* word, std::uint32_t val,
+               std::int64_t timeout_ns){
+  struct timespec ts;
+  struct timespec* tsp = nullptr;
+  if(timeout_ns >= 0){
+    ts.tv_sec = static_cast<time_t>(timeout_ns / 1000000000);
+    ts.tv_nsec = static_cast<long>(timeout_ns % 1000000000);
+    tsp = &ts;
+  }
+  syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAIT, val,
+          tsp, nullptr, 0);
+}
+
+void futexWake(std::atomic<std::uint32_t>* word, bool all){
+  syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), FUTEX_WAKE,
+          all ? INT_MAX : 1, nullptr, nullptr, 0);
+}
+
+Waiter::~Waiter(){
+  if(event_fd_ >= 0){
+    close(event_fd_);
+  }
+}
+
+int Waiter::enableEvent(){
+  if(event_fd_ < 0){
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(event_fd_ < 0){
+      std::cerr << "Warning: eventfd failed" << std::endl;
+    }
+  }
+  return event_fd_;
+}
+
+void Waiter::signalEvent(){
+  std::uint64_t one = 1;
+  ssize_t ret = ::write(event_fd_, &one, sizeof(one));
+  (void)ret;
+}
+
+void Waiter::drainEvent(){
+  std::uint64_t count = 0;
+  ssize_t ret = ::read(event_fd_, &count, sizeof(count));
+  (void)ret;
+}
@@ -1,24 +1,42 @@
 #include <porter.hpp>
 #include <time.h>
 #include <thread>
+#include <chrono>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 const std::size_t kBufferSize = 1 << 25; // set to 32MB
+const std::size_t kBatchSize = 16;
 std::queue<void*> gen_buffer;
 std::queue<std::size_t> send_size;
 std::queue<void*> recv_buffer;
-Porter ring;
+Porter* ring = nullptr;
+std::size_t total_size = 0;
+std::size_t sent_bytes = 0;
 
 void producer(){
     std::size_t total = 0;
     // randomly generate data
-    while(total < (1 << 30)){
+    while(total < total_size){
         std::size_t random_size = (rand() % (1 << 21)) + 1;
         char* random_buff = static_cast<char*>(std::malloc(random_size));
         for(std::size_t i = 0; i < random_size; ++i){
             random_buff[i] = rand() % 128;
         }
 
-        ring.write((void*)random_buff, random_size);
+        if(gen_buffer.size() % 2){
+            // gather every other buffer from a "header" and a "payload"
+            std::size_t head = random_size / 3;
+            struct iovec iov[2] = {{random_buff, head},
+                                   {random_buff + head, random_size - head}};
+            ring->writev(iov, 2);
+        }else{
+            ring->write((void*)random_buff, random_size);
+        }
         gen_buffer.push((void*)random_buff);
         printf("[Producer]: Sending buffer size of %zu bytes\n", random_size);
 
@@ -26,32 +44,49 @@ void producer(){
         send_size.push(random_size);
     }
     char end = 0;
-    ring.write((void*)(&end), 0);
+    ring->write((void*)(&end), 0);
+    sent_bytes = total;
     printf("[Producer]: Total Sent Data: %zu bytes\n", total);
 }
 
 void consumer(){
-    ring.resize(kBufferSize);
+    ring->resize(kBufferSize);
     std::size_t total = 0;
-    void* buffer = nullptr;
-    std::size_t recv = 0;
-    while(true){
-        // recving part
-        ring.read(&buffer, recv);
-        if(recv == 0){
-            break;
-        }
-        printf("[Consumer]: Recving buffer size of %zu bytes\n", recv);
-        // data handle part
-        char* buff = static_cast<char*>(std::malloc(recv));
-        if(buffer == nullptr){
-            std::cerr << "error" << std::endl;
-        }
-        memcpy(buff, buffer, recv);
-        recv_buffer.push((void*)buff);
+    Item records[kBatchSize];
+    std::size_t round = 0;
+    bool finished = false;
+    while(!finished){
+        // recving part: alternate single reads and batch reads
+        std::size_t count = 1;
+        if(round++ % 2){
+            count = ring->readBatch(records, kBatchSize, kBufferSize / 4);
+        }else{
+            ring->read(&records[0].buffer, records[0].size);
+        }
+        std::size_t idx = 0;
+        for(; idx < count; ++idx){
+            void* buffer = records[idx].buffer;
+            std::size_t recv = records[idx].size;
+            if(recv == 0){
+                finished = true;
+                break;
+            }
+            printf("[Consumer]: Recving buffer size of %zu bytes\n", recv);
+            // data handle part
+            char* buff = static_cast<char*>(std::malloc(recv));
+            if(buffer == nullptr){
+                std::cerr << "error" << std::endl;
+            }
+            memcpy(buff, buffer, recv);
+            recv_buffer.push((void*)buff);
+            total += recv;
+        }
         // consume
-        ring.consume();
-        total += recv;
+        if(count == 1 && idx == 1){
+            ring->consume();
+        }else{
+            ring->consumeN(idx);
+        }
     }
     printf("[Consumer]: Total Recved Data: %zu bytes\n", total);
 }
@@ -85,12 +120,951 @@ void verify(){
     printf("All buffer has been verified correct\n");
 }
 
-int main(){
-    srand((unsigned)time(NULL));
+// counters of a finished run: every record went in, all but the
+// end marker went out
+void checkStats(const ChannelStats& stats, std::size_t records, std::size_t bytes){
+#if CHANNEL_STATS
+    if(stats.records_in != records + 1 || stats.records_out != records ||
+       stats.bytes_in != bytes || stats.bytes_out != bytes ||
+       stats.high_water > (std::uint64_t)kBufferSize){
+        printf("Error: stats show %zu/%zu records and %zu/%zu bytes in/out, expected %zu+1 and %zu\n",
+               (std::size_t)stats.records_in, (std::size_t)stats.records_out,
+               (std::size_t)stats.bytes_in, (std::size_t)stats.bytes_out, records, bytes);
+        exit(-2);
+    }
+    printf("Stats: %zu writes waited %.3f ms, %zu reads waited %.3f ms, "
+           "high water %zu bytes, %zu wakeups, %zu padding bytes\n",
+           (std::size_t)stats.write_waits, stats.write_wait_ns / 1e6,
+           (std::size_t)stats.read_waits, stats.read_wait_ns / 1e6,
+           (std::size_t)stats.high_water, (std::size_t)stats.wakeups,
+           (std::size_t)stats.padding_bytes);
+#else
+    (void)stats;
+    (void)records;
+    (void)bytes;
+#endif
+}
+
+void run(const char* name, Porter* porter, std::size_t total){
+    printf("\n==== %s ====\n", name);
+    ring = porter;
+    total_size = total;
+    std::atomic<bool> done(false);
+    std::thread metrics([&] {
+        // poll like a metrics thread would, counters never go back
+        ChannelStats last = ring->stats();
+        while(!done.load()){
+            ChannelStats now = ring->stats();
+            if(now.records_in < last.records_in || now.records_out < last.records_out){
+                printf("Error: stats went back\n");
+                exit(-2);
+            }
+            last = now;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
     std::thread prod(producer);
     std::thread cons(consumer);
     prod.join();
     cons.join();
+    done.store(true);
+    metrics.join();
+    checkStats(ring->stats(), send_size.size(), sent_bytes);
     verify();
+    delete ring;
+}
+
+const std::size_t kEventRecords = 1 << 15;
+
+// consumer driven by `readFd` and `try_read` only, the producer
+// waits for budget through `writeFd`
+void runEventLoop(){
+    printf("\n==== event loop ====\n");
+    PorterOptions options;
+    options.event_fds = true;
+    Porter porter(options);
+    porter.resize(1 << 10);
+
+    void* buffer = nullptr;
+    std::size_t recv = 0;
+    if(porter.try_read(&buffer, recv) ||
+       porter.read_for(&buffer, recv, std::chrono::milliseconds(10))){
+        printf("Error: read from an empty porter\n");
+        exit(-2);
+    }
+
+    std::thread prod([&] {
+        int ep = epoll_create1(0);
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = 0;
+        epoll_ctl(ep, EPOLL_CTL_ADD, porter.writeFd(), &ev);
+        for(std::size_t seq = 0; seq < kEventRecords;){
+            if(porter.try_write(&seq, sizeof(seq))){
+                ++seq;
+                continue;
+            }
+            epoll_wait(ep, &ev, 1, -1);
+        }
+        close(ep);
+    });
+
+    int ep = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(ep, EPOLL_CTL_ADD, porter.readFd(), &ev);
+    for(std::size_t seq = 0; seq < kEventRecords;){
+        if(!porter.try_read(&buffer, recv)){
+            epoll_wait(ep, &ev, 1, -1);
+            continue;
+        }
+        std::size_t got = 0;
+        memcpy(&got, buffer, sizeof(got));
+        if(got != seq || recv != sizeof(got)){
+            printf("Error: got buffer %zu, expected %zu\n", got, seq);
+            exit(-2);
+        }
+        porter.consume();
+        ++seq;
+    }
+    close(ep);
+    prod.join();
+
+    std::size_t written = 0;
+    while(porter.try_write(&written, sizeof(written))){
+        ++written;
+    }
+    if(porter.write_for(&written, sizeof(written), std::chrono::milliseconds(10))){
+        printf("Error: wrote past the memory budget\n");
+        exit(-2);
+    }
+    printf("All %zu buffers verified correct by an event loop\n", kEventRecords);
+}
+
+const std::size_t kOverwriteRecords = 1 << 16;
+
+// lossy Porter with a small budget and a reader that is slow at
+// times: buffers arrive intact and in order, gaps are dropped ones
+void runOverwrite(){
+    printf("\n==== overwrite ====\n");
+    PorterOptions options;
+    options.overwrite = true;
+    Porter porter(options);
+    porter.resize(1 << 14);
+    std::atomic<bool> ack(false);
+    std::thread prod([&] {
+        std::vector<char> record;
+        for(std::size_t seq = 0; seq < kOverwriteRecords; ++seq){
+            record.resize(sizeof(seq) + seq % 512);
+            memcpy(record.data(), &seq, sizeof(seq));
+            porter.write(record.data(), record.size());
+        }
+        // empty end markers may be dropped too, repeat until seen
+        while(!ack.load()){
+            porter.write(record.data(), 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    Item items[kBatchSize];
+    std::size_t received = 0;
+    std::uint64_t expected = 0;
+    while(!ack.load()){
+        std::size_t count = porter.readBatch(items, kBatchSize);
+        for(std::size_t i = 0; i < count; ++i){
+            if(items[i].size == 0){
+                ack.store(true);
+                break;
+            }
+            std::size_t got = 0;
+            memcpy(&got, items[i].buffer, sizeof(got));
+            if(got != items[i].seq || got < expected ||
+               items[i].size != sizeof(got) + got % 512){
+                printf("Error: got buffer %zu (seq %zu), expected at least %zu\n",
+                       got, (std::size_t)items[i].seq, (std::size_t)expected);
+                exit(-2);
+            }
+            expected = got + 1;
+            ++received;
+        }
+        if(received % 5 == 0){
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        porter.consumeN(count);
+    }
+    prod.join();
+    std::size_t lost = kOverwriteRecords - received;
+    if(porter.dropped() < lost){
+        printf("Error: %zu buffers lost but only %zu counted as dropped\n", lost,
+               (std::size_t)porter.dropped());
+        exit(-2);
+    }
+    printf("%zu buffers received, %zu dropped, all verified correct\n", received, lost);
+}
+
+const std::size_t kRecycleRecords = 1 << 18;
+const std::size_t kRecycleBudget = 1 << 18;
+
+// small budget and sizes hopping between classes, so blocks are
+// recycled, trimmed and allocated again all the time
+void runRecycle(){
+    printf("\n==== recycle ====\n");
+    for(std::size_t size = 0; size <= SlabPool::kMaxBlock + 1; size += 1 + size / 7){
+        std::size_t block = SlabPool::blockSize(size);
+        if(block < size || block > size + size / 4 + SlabPool::kMinBlock){
+            printf("Error: block of %zu bytes for a %zu byte buffer\n", block, size);
+            exit(-2);
+        }
+    }
+    Porter porter;
+    porter.resize(kRecycleBudget);
+    std::thread prod([&] {
+        unsigned seed = 3;
+        std::vector<char> record;
+        for(std::size_t seq = 0; seq < kRecycleRecords; ++seq){
+            record.resize(sizeof(seq) + (seq % 64 == 0 ? rand_r(&seed) % (1 << 16)
+                                                         : rand_r(&seed) % 2048));
+            memcpy(record.data(), &seq, sizeof(seq));
+            for(std::size_t i = sizeof(seq); i < record.size(); ++i){
+                record[i] = (char)(seq + i);
+            }
+            porter.write(record.data(), record.size());
+        }
+    });
+    for(std::size_t seq = 0; seq < kRecycleRecords; ++seq){
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        porter.read(&buffer, size);
+        const char* data = static_cast<const char*>(buffer);
+        std::size_t got = 0;
+        memcpy(&got, data, sizeof(got));
+        if(got != seq){
+            printf("Error: got buffer %zu, expected %zu\n", got, seq);
+            exit(-2);
+        }
+        for(std::size_t i = sizeof(seq); i < size; ++i){
+            if(data[i] != (char)(seq + i)){
+                printf("Error: %zu-th buffer is different\n", seq);
+                exit(-2);
+            }
+        }
+        porter.consume();
+    }
+    prod.join();
+#if CHANNEL_STATS
+    if(porter.stats().high_water > kRecycleBudget){
+        printf("Error: footprint went up to %zu bytes\n", (std::size_t)porter.stats().high_water);
+        exit(-2);
+    }
+#endif
+    printf("All %zu buffers verified correct within the budget\n", kRecycleRecords);
+}
+
+const std::size_t kAdoptRecords = 1 << 10;
+std::atomic<std::size_t> adopt_freed(0);
+
+struct CountingDelete {
+    void operator()(char* buffer) const {
+        ++adopt_freed;
+        delete[] buffer;
+    }
+};
+
+// a deleter with state, kept by the Porter until the buffer is freed
+struct TaggedDelete {
+    std::size_t tag;
+    std::atomic<std::size_t>* freed;
+    void operator()(char* buffer) const {
+        std::size_t seq = 0;
+        memcpy(&seq, buffer, sizeof(seq));
+        if(seq != tag){
+            printf("Error: deleter of buffer %zu freed buffer %zu\n", tag, seq);
+            exit(-2);
+        }
+        ++*freed;
+        delete[] buffer;
+    }
+};
+
+// buffers handed over without a copy: the consumer must see the
+// producer's pointers, and every one of them freed once
+void runAdopt(){
+    printf("\n==== adopt ====\n");
+    std::vector<char*> sent(kAdoptRecords);
+    {
+        Porter porter;
+        porter.resize(kRecycleBudget * 64);
+        std::thread prod([&] {
+            for(std::size_t seq = 0; seq < kAdoptRecords; ++seq){
+                std::size_t size = sizeof(seq) + (seq * 7919) % (4 << 20);
+                char* buffer = new char[size];
+                memcpy(buffer, &seq, sizeof(seq));
+                buffer[size - 1] = (char)seq;
+                sent[seq] = buffer;
+                if(seq % 4 == 3){
+                    porter.write(std::unique_ptr<char[], TaggedDelete>(
+                                     buffer, TaggedDelete{seq, &adopt_freed}), size);
+                }else if(seq % 2){
+                    porter.write(std::unique_ptr<char[], CountingDelete>(buffer), size);
+                }else{
+                    porter.write(buffer, size, [](void* ptr, void*) {
+                        ++adopt_freed;
+                        delete[] static_cast<char*>(ptr);
+                    });
+                }
+            }
+        });
+        for(std::size_t seq = 0; seq < kAdoptRecords; ++seq){
+            void* buffer = nullptr;
+            std::size_t size = 0;
+            porter.read(&buffer, size);
+            std::size_t got = 0;
+            memcpy(&got, buffer, sizeof(got));
+            if(got != seq || static_cast<char*>(buffer)[size - 1] != (char)seq){
+                printf("Error: got buffer %zu, expected %zu\n", got, seq);
+                exit(-2);
+            }
+            if(buffer != sent[seq]){
+                printf("Error: %zu-th buffer was copied\n", seq);
+                exit(-2);
+            }
+            // leave the last one for the destructor
+            if(seq + 1 < kAdoptRecords){
+                porter.consume();
+            }
+        }
+        prod.join();
+    }
+    if(adopt_freed != kAdoptRecords){
+        printf("Error: %zu of %zu buffers freed\n", (std::size_t)adopt_freed, kAdoptRecords);
+        exit(-2);
+    }
+    // plain unique_ptr<char[]> goes through delete[]
+    Porter porter;
+    porter.resize(1 << 10);
+    for(int i = 0; i < 64; ++i){
+        porter.write(std::unique_ptr<char[]>(new char[1 << 10]), 1 << 10);
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        porter.read(&buffer, size);
+        porter.consume();
+    }
+    printf("All %zu buffers passed through without copy and freed once\n", kAdoptRecords);
+}
+
+const std::size_t kOutOfOrderRounds = 256;
+
+// fill the budget, read everything and consume it in random order:
+// every consumed buffer must be back in the budget right away
+void runOutOfOrder(){
+    printf("\n==== out of order ====\n");
+    Porter porter;
+    porter.resize(kRecycleBudget);
+    unsigned seed = 7;
+    std::vector<char> record(4096);
+    std::size_t records = 0;
+    for(std::size_t round = 0; round < kOutOfOrderRounds; ++round){
+        std::vector<std::size_t> sizes;
+        while(true){
+            std::size_t size = sizeof(std::size_t) + rand_r(&seed) % 4000;
+            std::size_t seq = sizes.size();
+            memcpy(record.data(), &seq, sizeof(seq));
+            if(!porter.try_write(record.data(), size)){
+                break;
+            }
+            sizes.push_back(size);
+        }
+        std::vector<Item> held(sizes.size());
+        for(std::size_t got = 0; got < held.size();){
+            got += porter.readBatch(held.data() + got, held.size() - got);
+        }
+        std::vector<std::size_t> order;
+        for(std::size_t i = 0; i < held.size(); ++i){
+            std::size_t seq = 0;
+            memcpy(&seq, held[i].buffer, sizeof(seq));
+            if(seq != i || held[i].size != sizes[i]){
+                printf("Error: got buffer %zu, expected %zu\n", seq, i);
+                exit(-2);
+            }
+            order.push_back(i);
+        }
+        std::shuffle(order.begin(), order.end(), std::minstd_rand(seed));
+        // each consumed buffer frees room for one of its size, even
+        // with the oldest one still held
+        for(std::size_t i : order){
+            if(i == 0){
+                continue;
+            }
+            porter.consumeBuffer(held[i].buffer);
+            if(!porter.try_write(record.data(), sizes[i])){
+                printf("Error: buffer %zu not released\n", i);
+                exit(-2);
+            }
+            void* buffer = nullptr;
+            std::size_t size = 0;
+            porter.read(&buffer, size);
+            porter.consumeBuffer(buffer);
+        }
+        porter.consume();
+        records += 2 * held.size() - 1;
+    }
+    void* buffer = nullptr;
+    std::size_t size = 0;
+    if(porter.try_read(&buffer, size)){
+        printf("Error: read from an empty Porter\n");
+        exit(-2);
+    }
+#if CHANNEL_STATS
+    ChannelStats stats = porter.stats();
+    if(stats.records_out != records || stats.bytes_out != stats.bytes_in){
+        printf("Error: %zu of %zu buffers counted out\n", (std::size_t)stats.records_out, records);
+        exit(-2);
+    }
+    // only polls that found the budget used up or nothing to read
+    if(stats.write_waits != 0 || stats.read_waits != 0){
+        printf("Error: polls counted as %zu write and %zu read waits\n",
+               (std::size_t)stats.write_waits, (std::size_t)stats.read_waits);
+        exit(-2);
+    }
+#endif
+    printf("All %zu buffers consumed out of order\n", records);
+}
+
+const std::size_t kSpillRecords = 1 << 15;
+
+void spillRecord(std::vector<char>& record, std::size_t seq){
+    record.resize(sizeof(seq) + (seq * 7919) % 4096);
+    memcpy(record.data(), &seq, sizeof(seq));
+    for(std::size_t i = sizeof(seq); i < record.size(); ++i){
+        record[i] = (char)(seq + i);
+    }
+}
+
+void checkSpillRecord(const void* buffer, std::size_t size, std::size_t seq){
+    const char* data = static_cast<const char*>(buffer);
+    std::size_t got = 0;
+    memcpy(&got, data, sizeof(got));
+    if(got != seq || size != sizeof(seq) + (seq * 7919) % 4096){
+        printf("Error: got buffer %zu, expected %zu\n", got, seq);
+        exit(-2);
+    }
+    for(std::size_t i = sizeof(seq); i < size; ++i){
+        if(data[i] != (char)(seq + i)){
+            printf("Error: %zu-th buffer is different\n", seq);
+            exit(-2);
+        }
+    }
+}
+
+// a budget far too small for the load: the producer must never
+// block, the overflow comes back from disk in order
+void runSpill(){
+    printf("\n==== spill ====\n");
+    PorterOptions options;
+    options.spill_path = "/tmp/test_porter_spill_" + std::to_string(getpid());
+    Porter porter(options);
+    porter.resize(kRecycleBudget);
+    std::vector<char> record;
+    // nobody reads while all of it is written
+    for(std::size_t seq = 0; seq < kSpillRecords; ++seq){
+        spillRecord(record, seq);
+        if(!porter.try_write(record.data(), record.size())){
+            printf("Error: write %zu blocked with a spill file\n", seq);
+            exit(-2);
+        }
+    }
+    if(porter.spilled() == 0 || access(options.spill_path.c_str(), F_OK) == 0){
+        printf("Error: %zu buffers spilled, spill file left behind\n",
+               (std::size_t)porter.spilled());
+        exit(-2);
+    }
+    Item records[kBatchSize];
+    for(std::size_t seq = 0; seq < kSpillRecords;){
+        std::size_t count = porter.readBatch(records, kBatchSize);
+        for(std::size_t i = 0; i < count; ++i, ++seq){
+            checkSpillRecord(records[i].buffer, records[i].size, seq);
+        }
+        porter.consumeN(count);
+    }
+    std::size_t first = (std::size_t)porter.spilled();
+    // then a slow consumer, so the file is drained and reused
+    std::thread prod([&] {
+        std::vector<char> record;
+        for(std::size_t seq = 0; seq < kSpillRecords; ++seq){
+            spillRecord(record, seq);
+            porter.write(record.data(), record.size());
+        }
+    });
+    for(std::size_t seq = 0; seq < kSpillRecords; ++seq){
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        porter.read(&buffer, size);
+        checkSpillRecord(buffer, size, seq);
+        if(seq % 1024 == 0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        porter.consume();
+    }
+    prod.join();
+#if CHANNEL_STATS
+    ChannelStats stats = porter.stats();
+    if(stats.records_out != 2 * kSpillRecords || stats.bytes_out != stats.bytes_in ||
+       stats.high_water > kRecycleBudget){
+        printf("Error: %zu of %zu buffers given back, footprint up to %zu bytes\n",
+               (std::size_t)stats.records_out, 2 * kSpillRecords, (std::size_t)stats.high_water);
+        exit(-2);
+    }
+#endif
+    printf("All %zu buffers verified correct, %zu + %zu of them spilled\n",
+           2 * kSpillRecords, first, (std::size_t)porter.spilled() - first);
+}
+
+const std::size_t kGovernorLimit = 1 << 20;
+const std::size_t kGovernorMin = 1 << 16;
+const std::size_t kGoverned = 8;
+const std::size_t kGovernedRecords = 1 << 13;
+
+// Porters sharing one limit: a busy one borrows what idle ones
+// leave, and under load a writer of large buffers still gets its
+// turn between the small ones
+void runGovernor(){
+    printf("\n==== governor ====\n");
+    MemoryGovernor governor(kGovernorLimit);
+    PorterOptions options;
+    options.governor = &governor;
+    options.governor_min = kGovernorMin;
+    std::vector<std::unique_ptr<Porter>> porters;
+    for(std::size_t i = 0; i < kGoverned; ++i){
+        porters.emplace_back(new Porter(options));
+        porters.back()->resize(kGovernorLimit);
+    }
+    try{
+        options.governor_min = kGovernorLimit;
+        Porter porter(options);
+        printf("Error: governor promised more than its limit\n");
+        exit(-2);
+    }catch(const std::invalid_argument&){
+    }
+    // a Porter that fails to start gives its minimum back
+    options.governor_min = kGovernorMin;
+    options.spill_path = "/nonexistent/toys_test_spill";
+    try{
+        Porter porter(options);
+        printf("Error: spill file opened in a missing directory\n");
+        exit(-2);
+    }catch(const std::runtime_error&){
+    }
+    options.spill_path.clear();
+    if(governor.reserved() != kGoverned * kGovernorMin){
+        printf("Error: failed Porter left %zu bytes reserved\n",
+               governor.reserved() - kGoverned * kGovernorMin);
+        exit(-2);
+    }
+    // one busy Porter while the others idle
+    std::vector<char> record(1 << 18, 'g');
+    std::size_t held = 0;
+    while(porters[0]->try_write(record.data(), 1024)){
+        held += SlabPool::blockSize(1024);
+    }
+    std::size_t open = kGovernorLimit - kGoverned * kGovernorMin;
+    if(held < kGovernorMin + open - SlabPool::blockSize(1024) || held > kGovernorMin + open){
+        printf("Error: busy Porter got %zu bytes, expected %zu\n", held, kGovernorMin + open);
+        exit(-2);
+    }
+    // the others still get their minimum
+    for(std::size_t i = 1; i < kGoverned; ++i){
+        if(!porters[i]->try_write(record.data(), kGovernorMin / 2)){
+            printf("Error: Porter %zu didn't get its minimum\n", i);
+            exit(-2);
+        }
+    }
+    for(std::size_t i = 0; i < kGoverned; ++i){
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        while(porters[i]->try_read(&buffer, size)){
+            porters[i]->consume();
+        }
+    }
+    // all of them busy, Porter 0 with buffers of a quarter of the limit
+    std::vector<std::thread> threads;
+    for(std::size_t i = 0; i < kGoverned; ++i){
+        Porter* porter = porters[i].get();
+        std::size_t size = i == 0 ? kGovernorLimit / 4 : 1024 + i;
+        threads.emplace_back([porter, size] {
+            for(std::size_t seq = 0; seq < kGovernedRecords; ++seq){
+                std::vector<char> data(size, (char)seq);
+                memcpy(data.data(), &seq, sizeof(seq));
+                porter->write(data.data(), size);
+            }
+        });
+        threads.emplace_back([porter, size] {
+            for(std::size_t seq = 0; seq < kGovernedRecords; ++seq){
+                void* buffer = nullptr;
+                std::size_t got_size = 0;
+                porter->read(&buffer, got_size);
+                std::size_t got = 0;
+                memcpy(&got, buffer, sizeof(got));
+                if(got != seq || got_size != size ||
+                   static_cast<char*>(buffer)[size - 1] != (char)seq){
+                    printf("Error: got buffer %zu, expected %zu\n", got, seq);
+                    exit(-2);
+                }
+                porter->consume();
+            }
+        });
+    }
+    for(std::thread& thread : threads){
+        thread.join();
+    }
+    for(std::size_t i = 0; i < kGoverned; ++i){
+#if CHANNEL_STATS
+        std::size_t high = (std::size_t)porters[i]->stats().high_water;
+        if(high > kGovernorMin + open){
+            printf("Error: Porter %zu went up to %zu bytes\n", i, high);
+            exit(-2);
+        }
+#endif
+    }
+    porters.clear();
+    if(governor.shared() != 0 || governor.reserved() != 0){
+        printf("Error: %zu shared and %zu reserved bytes left\n", governor.shared(),
+               governor.reserved());
+        exit(-2);
+    }
+    printf("All %zu buffers of %zu Porters verified correct within %zu bytes\n",
+           kGoverned * kGovernedRecords, kGoverned, kGovernorLimit);
+}
+
+const std::size_t kAutoMin = 1 << 16;
+const std::size_t kAutoMax = 1 << 23;
+const std::size_t kAutoRecord = 4096;
+
+// the budget grows behind a slow consumer and comes back down,
+// with its cached blocks freed, once the consumer keeps up
+void runAutoSize(){
+    printf("\n==== auto size ====\n");
+    PorterOptions options;
+    options.auto_size_min = kAutoMax;
+    options.auto_size_max = kAutoMin;
+    try{
+        Porter porter(options);
+        printf("Error: auto size accepted min > max\n");
+        exit(-2);
+    }catch(const std::invalid_argument&){
+    }
+    options.auto_size_min = kAutoMin;
+    options.auto_size_max = kAutoMax;
+    Porter porter(options);
+    std::atomic<bool> slow(true);
+    std::atomic<bool> done(false);
+    std::atomic<std::size_t> received(0);
+    std::thread reader([&] {
+        std::size_t seq = 0;
+        while(true){
+            void* buffer = nullptr;
+            std::size_t size = 0;
+            if(!porter.read_for(&buffer, size, std::chrono::milliseconds(10))){
+                if(done.load()){
+                    break;
+                }
+                continue;
+            }
+            std::size_t got = 0;
+            memcpy(&got, buffer, sizeof(got));
+            if(got != seq || size != kAutoRecord){
+                printf("Error: got buffer %zu, expected %zu\n", got, seq);
+                exit(-2);
+            }
+            porter.consume();
+            ++seq;
+            received.store(seq);
+            if(slow.load()){
+                std::this_thread::sleep_for(std::chrono::microseconds(20));
+            }
+        }
+    });
+    std::vector<char> record(kAutoRecord, 'a');
+    std::size_t seq = 0;
+    auto write = [&] {
+        memcpy(record.data(), &seq, sizeof(seq));
+        porter.write(record.data(), record.size());
+        ++seq;
+    };
+    // slow consumer: the producer stalls
+    for(std::size_t i = 0; i < (1 << 14); ++i){
+        write();
+    }
+    AutoSizeStats heavy = porter.autoSizeStats();
+    if(heavy.grows == 0 || heavy.budget <= kAutoMin || heavy.budget > kAutoMax){
+        printf("Error: budget %zu after %zu grows\n", heavy.budget, (std::size_t)heavy.grows);
+        exit(-2);
+    }
+    slow.store(false);
+    while(received.load() < seq){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::size_t footprint = porter.autoSizeStats().footprint;
+    // the consumer keeps up: a trickle of writes
+    auto light_end = std::chrono::steady_clock::now() + std::chrono::milliseconds(1500);
+    while(std::chrono::steady_clock::now() < light_end){
+        write();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    done.store(true);
+    reader.join();
+    AutoSizeStats light = porter.autoSizeStats();
+    if(light.shrinks == 0 || light.budget != kAutoMin || light.released_bytes == 0 ||
+       light.footprint >= footprint){
+        printf("Error: budget %zu after %zu shrinks, %zu of %zu bytes left\n", light.budget,
+               (std::size_t)light.shrinks, light.footprint, footprint);
+        exit(-2);
+    }
+    printf("Budget grew %zu times up to %zu bytes, shrank %zu times to %zu and freed %zu bytes\n",
+           (std::size_t)light.grows, heavy.budget, (std::size_t)light.shrinks, light.budget,
+           (std::size_t)light.released_bytes);
+}
+
+const std::size_t kLaneBudget = 1 << 20;
+const std::size_t kLaneReserve = 1 << 16;
+const std::size_t kLaneRecord = 4096;
+
+// read `expect` lanes in order, in buffers tagged with their lane
+void checkLanes(Porter& porter, const std::string& expect){
+    for(std::size_t i = 0; i < expect.size(); ++i){
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        if(!porter.try_read(&buffer, size) || static_cast<char*>(buffer)[0] != expect[i]){
+            printf("Error: read %zu of \"%s\" came from the wrong lane\n", i, expect.c_str());
+            exit(-2);
+        }
+        porter.consume();
+    }
+}
+
+// control buffers overtake bulk ones and still get budget once the
+// bulk lane filled its share
+void runLanes(){
+    printf("\n==== lanes ====\n");
+    PorterOptions options;
+    options.lanes = 2;
+    options.overwrite = true;
+    try{
+        Porter porter(options);
+        printf("Error: lanes accepted overwrite\n");
+        exit(-2);
+    }catch(const std::invalid_argument&){
+    }
+    options.overwrite = false;
+    char bulk[] = "0";
+    char control[] = "1";
+    {
+        Porter porter(options);
+        porter.resize(kLaneBudget);
+        for(int i = 0; i < 3; ++i){
+            porter.write(bulk, sizeof(bulk));
+        }
+        porter.write(1, control, sizeof(control));
+        porter.write(1, control, sizeof(control));
+        checkLanes(porter, "11000");
+    }
+    {
+        // with weights {1, 1, 1} lane 2 passes every other turn
+        // down, lane 1 every other one of those
+        PorterOptions three;
+        three.lanes = 3;
+        three.lane_weights = {1, 1, 1};
+        Porter porter(three);
+        porter.resize(kLaneBudget);
+        for(std::size_t lane = 0; lane < 3; ++lane){
+            char tag[] = {static_cast<char>('0' + lane), 0};
+            for(int i = 0; i < 4; ++i){
+                porter.write(lane, tag, sizeof(tag));
+            }
+        }
+        checkLanes(porter, "212021201010");
+        // same order from the locked queue of a consumer pool
+        SafeQueue<char> queue(WaitStrategy::kBlocking, 3, three.lane_weights);
+        for(std::size_t lane = 0; lane < 3; ++lane){
+            for(int i = 0; i < 4; ++i){
+                queue.push(static_cast<char>('0' + lane), lane);
+            }
+        }
+        std::string order;
+        char tag = 0;
+        while(queue.try_fpop(tag)){
+            order += tag;
+        }
+        if(order != "212021201010"){
+            printf("Error: queue served lanes as \"%s\"\n", order.c_str());
+            exit(-2);
+        }
+    }
+    options.lane_weights = {0, 2};
+    options.lane_reserve = {0, kLaneReserve};
+    Porter porter(options);
+    porter.resize(kLaneBudget);
+    std::vector<char> record(kLaneRecord, '0');
+    std::size_t bulks = 0;
+    while(porter.try_write(record.data(), record.size())){
+        ++bulks;
+    }
+    if(bulks * kLaneRecord != kLaneBudget - kLaneReserve){
+        printf("Error: bulk lane took %zu bytes\n", bulks * kLaneRecord);
+        exit(-2);
+    }
+    record[0] = '1';
+    std::size_t controls = 0;
+    while(porter.try_write(1, record.data(), record.size())){
+        ++controls;
+    }
+    if(controls * kLaneRecord != kLaneReserve){
+        printf("Error: control lane got %zu bytes of its reserve\n", controls * kLaneRecord);
+        exit(-2);
+    }
+    // two control buffers for each bulk one while both wait
+    std::string expect;
+    for(std::size_t i = 0; i < controls / 2; ++i){
+        expect += "110";
+    }
+    expect += std::string(bulks - controls / 2, '0');
+    checkLanes(porter, expect);
+    // consumed control blocks stay cached, bulk writes can't take them
+    record[0] = '0';
+    while(porter.try_write(record.data(), record.size())){
+        ++bulks;
+    }
+    record[0] = '1';
+    if(!porter.try_write(1, record.data(), record.size())){
+        printf("Error: bulk lane took the control reserve\n");
+        exit(-2);
+    }
+    printf("Bulk lane held %zu bytes, control lane kept %zu, weighted order verified\n",
+           kLaneBudget - kLaneReserve, controls * kLaneRecord);
+}
+
+const std::size_t kWorkerRecords = 1 << 17;
+const std::size_t kWorkers = 8;
+
+// a pool of consumers sharing one producer: every buffer reaches
+// exactly one of them and all of them are given back to the budget
+void runWorkers(){
+    printf("\n==== %zu workers ====\n", kWorkers);
+    PorterOptions invalid;
+    invalid.consumers = 2;
+    invalid.overwrite = true;
+    try{
+        Porter porter(invalid);
+        printf("Error: overwrite accepted with several consumers\n");
+        exit(-2);
+    }catch(const std::invalid_argument&){
+    }
+    PorterOptions options;
+    options.consumers = kWorkers;
+    Porter porter(options);
+    porter.resize(kRecycleBudget);
+    std::vector<std::atomic<int>> seen(kWorkerRecords);
+    for(std::size_t i = 0; i < kWorkerRecords; ++i){
+        seen[i] = 0;
+    }
+    // a consumer only reads what it claimed, so no one blocks forever
+    std::atomic<std::size_t> unclaimed(kWorkerRecords);
+    std::vector<std::size_t> handled(kWorkers, 0);
+    std::vector<std::thread> workers;
+    for(std::size_t c = 0; c < kWorkers; ++c){
+        workers.emplace_back([&, c] {
+            Item records[kBatchSize];
+            while(true){
+                std::size_t left = unclaimed.load();
+                std::size_t claim = 0;
+                do{
+                    claim = left < kBatchSize ? left : kBatchSize;
+                }while(claim > 0 && !unclaimed.compare_exchange_weak(left, left - claim));
+                if(claim == 0){
+                    break;
+                }
+                for(std::size_t got = 0; got < claim;){
+                    std::size_t count = 1;
+                    if(claim - got == 1){
+                        porter.read(c, &records[0].buffer, records[0].size);
+                    }else{
+                        count = porter.readBatch(c, records, claim - got, SIZE_MAX);
+                    }
+                    for(std::size_t i = 0; i < count; ++i){
+                        std::size_t seq = 0;
+                        memcpy(&seq, records[i].buffer, sizeof(seq));
+                        if(seq >= kWorkerRecords || seen[seq]++ != 0 ||
+                           records[i].size != sizeof(seq) + seq % 512){
+                            printf("Error: buffer %zu seen twice or damaged\n", seq);
+                            exit(-2);
+                        }
+                    }
+                    got += count;
+                    handled[c] += count;
+                    // hold the handles of two reads now and then
+                    if(got % 2 == 0 || got == claim){
+                        porter.consumeN(c, SIZE_MAX);
+                    }
+                }
+            }
+        });
+    }
+    std::vector<char> record(sizeof(std::size_t) + 512);
+    for(std::size_t seq = 0; seq < kWorkerRecords; ++seq){
+        memcpy(record.data(), &seq, sizeof(seq));
+        porter.write(record.data(), sizeof(seq) + seq % 512);
+    }
+    for(std::thread& worker : workers){
+        worker.join();
+    }
+    for(std::size_t seq = 0; seq < kWorkerRecords; ++seq){
+        if(seen[seq] != 1){
+            printf("Error: buffer %zu never arrived\n", seq);
+            exit(-2);
+        }
+    }
+#if CHANNEL_STATS
+    ChannelStats stats = porter.stats();
+    if(stats.records_out != kWorkerRecords || stats.bytes_out != stats.bytes_in ||
+       stats.high_water > kRecycleBudget){
+        printf("Error: %zu of %zu buffers given back, footprint up to %zu bytes\n",
+               (std::size_t)stats.records_out, kWorkerRecords, (std::size_t)stats.high_water);
+        exit(-2);
+    }
+#endif
+    for(std::size_t c = 0; c < kWorkers; ++c){
+        printf("[Worker %zu]: %zu buffers\n", c, handled[c]);
+    }
+    printf("All %zu buffers handled exactly once by %zu workers\n", kWorkerRecords, kWorkers);
+}
+
+int main(){
+    srand((unsigned)time(NULL));
+    run("malloc", new Porter(), 1 << 30);
+
+    MemPlacement placement;
+    placement.huge_pages = HugePages::kTransparent;
+    placement.prefault = true;
+    placement.numa_node = currentNumaNode();
+    run("placed", new Porter(placement), 1 << 28);
+
+    const WaitStrategy strategies[] = {WaitStrategy::kSpin, WaitStrategy::kSpinYield,
+                                       WaitStrategy::kSpinFutex};
+    const char* strategy_names[] = {"wait spin", "wait spin-yield", "wait spin-futex"};
+    for(int i = 0; i < 3; ++i){
+        PorterOptions options;
+        options.wait = strategies[i];
+        run(strategy_names[i], new Porter(options), 1 << 26);
+    }
+
+    runEventLoop();
+    runOverwrite();
+    runRecycle();
+    runAdopt();
+    runOutOfOrder();
+    runSpill();
+    runGovernor();
+    runAutoSize();
+    runLanes();
+    runWorkers();
     return 0;
 }
\ No newline at end of file
@@ -1,23 +1,50 @@
 #include <ringbuff.hpp>
 #include <time.h>
+#include <algorithm>
+#include <queue>
+#include <random>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 const int kBufferSize = 1 << 25; // set to 32MB
+const std::size_t kBatchSize = 16;
 std::queue<void*> gen_buffer;
 std::queue<std::size_t> send_size;
 std::queue<void*> recv_buffer;
-class RingBuffer ring(kBufferSize);
+RingBuffer* ring = nullptr;
+std::size_t total_size = 0;
+std::size_t sent_bytes = 0;
 
 void producer(){
     std::size_t total = 0;
     // randomly generate data
-    while(total < (1 << 30)){
+    while(total < total_size){
         std::size_t random_size = (rand() % (1 << 21)) + 1;
         char* random_buff = static_cast<char*>(std::malloc(random_size));
         for(std::size_t i = 0; i < random_size; ++i){
             random_buff[i] = rand() % 128;
         }
 
-        ring.write((void*)random_buff, random_size);
+        if(gen_buffer.size() % 3 == 1){
+            // build some records in place
+            void* slot = ring->reserve(random_size);
+            memcpy(slot, random_buff, random_size);
+            ring->commit(random_size);
+        }else if(gen_buffer.size() % 3 == 2){
+            // and gather others from a "header" and a "payload"
+            std::size_t head = random_size / 3;
+            struct iovec iov[2] = {{random_buff, head},
+                                   {random_buff + head, random_size - head}};
+            ring->writev(iov, 2);
+        }else{
+            ring->write((void*)random_buff, random_size);
+        }
         gen_buffer.push((void*)random_buff);
         printf("[Producer]: Sending buffer size of %zu bytes\n", random_size);
 
@@ -25,31 +52,52 @@ void producer(){
         send_size.push(random_size);
     }
     char end = 0;
-    ring.write((void*)(&end), 0);
+    ring->write((void*)(&end), 0);
+    sent_bytes = total;
     printf("[Producer]: Total Sent Data: %zu bytes\n", total);
 }
 
 void consumer(){
     std::size_t total = 0;
-    void* buffer = nullptr;
-    std::size_t recv = 0;
-    while(true){
-        // recving part
-        ring.read(&buffer, recv);
-        if(recv == 0){
-            break;
-        }
-        printf("[Consumer]: Recving buffer size of %zu bytes\n", recv);
-        // data handle part
-        char* buff = static_cast<char*>(std::malloc(recv));
-        if(buffer == nullptr){
-            std::cerr << "error" << std::endl;
-        }
-        memcpy(buff, buffer, recv);
-        recv_buffer.push((void*)buff);
+    RingRecord records[kBatchSize];
+    std::size_t round = 0;
+    bool finished = false;
+    while(!finished){
+        // recving part: alternate single reads and batch reads
+        std::size_t count = 1;
+        if(round++ % 2){
+            count = ring->readBatch(records, kBatchSize, kBufferSize / 4);
+        }else{
+            ring->read(&records[0].buffer, records[0].size);
+        }
+        std::size_t idx = 0;
+        for(; idx < count; ++idx){
+            void* buffer = records[idx].buffer;
+            std::size_t recv = records[idx].size;
+            if(recv == 0){
+                finished = true;
+                break;
+            }
+            printf("[Consumer]: Recving buffer size of %zu bytes\n", recv);
+            if((uintptr_t)buffer % ring->align() != 0){
+                printf("Error: payload at %p not aligned to %zu\n", buffer, ring->align());
+                exit(-2);
+            }
+            // data handle part
+            char* buff = static_cast<char*>(std::malloc(recv));
+            if(buffer == nullptr){
+                std::cerr << "error" << std::endl;
+            }
+            memcpy(buff, buffer, recv);
+            recv_buffer.push((void*)buff);
+            total += recv;
+        }
         // consume
-        ring.consume();
-        total += recv;
+        if(count == 1 && idx == 1){
+            ring->consume();
+        }else{
+            ring->consumeN(idx);
+        }
     }
     printf("[Consumer]: Total Recved Data: %zu bytes\n", total);
 }
@@ -83,12 +131,677 @@ void verify(){
     printf("All buffer has been verified correct\n");
 }
 
-int main(){
-    srand((unsigned)time(NULL));
+// counters of a finished run: every record went in, all but the
+// end marker went out
+void checkStats(const ChannelStats& stats, std::size_t records, std::size_t bytes){
+#if CHANNEL_STATS
+    if(stats.records_in != records + 1 || stats.records_out != records ||
+       stats.bytes_in != bytes || stats.bytes_out != bytes ||
+       stats.high_water > (std::uint64_t)kBufferSize){
+        printf("Error: stats show %zu/%zu records and %zu/%zu bytes in/out, expected %zu+1 and %zu\n",
+               (std::size_t)stats.records_in, (std::size_t)stats.records_out,
+               (std::size_t)stats.bytes_in, (std::size_t)stats.bytes_out, records, bytes);
+        exit(-2);
+    }
+    printf("Stats: %zu writes waited %.3f ms, %zu reads waited %.3f ms, "
+           "high water %zu bytes, %zu wakeups, %zu padding bytes\n",
+           (std::size_t)stats.write_waits, stats.write_wait_ns / 1e6,
+           (std::size_t)stats.read_waits, stats.read_wait_ns / 1e6,
+           (std::size_t)stats.high_water, (std::size_t)stats.wakeups,
+           (std::size_t)stats.padding_bytes);
+#else
+    (void)stats;
+    (void)records;
+    (void)bytes;
+#endif
+}
+
+void run(const char* name, const RingOptions& options, std::size_t total){
+    printf("\n==== %s ====\n", name);
+    ring = new RingBuffer(kBufferSize, options);
+    total_size = total;
+    std::atomic<bool> done(false);
+    std::thread metrics([&] {
+        // poll like a metrics thread would, counters never go back
+        ChannelStats last = ring->stats();
+        while(!done.load()){
+            ChannelStats now = ring->stats();
+            if(now.records_in < last.records_in || now.records_out < last.records_out){
+                printf("Error: stats went back\n");
+                exit(-2);
+            }
+            last = now;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
     std::thread prod(producer);
     std::thread cons(consumer);
     prod.join();
     cons.join();
+    done.store(true);
+    metrics.join();
+    checkStats(ring->stats(), send_size.size(), sent_bytes);
     verify();
+    delete ring;
+}
+
+const int kProducers = 16;
+const std::size_t kRecordsPerProducer = 1 << 14;
+
+void multiProducer(int id){
+    unsigned seed = id;
+    std::vector<char> record;
+    for(std::size_t seq = 0; seq < kRecordsPerProducer; ++seq){
+        // [id][seq][bytes derived from id and seq]
+        std::size_t random_size = 2 * sizeof(std::uint32_t) + rand_r(&seed) % 4096;
+        record.resize(random_size);
+        std::uint32_t head[2] = {(std::uint32_t)id, (std::uint32_t)seq};
+        memcpy(record.data(), head, sizeof(head));
+        for(std::size_t i = sizeof(head); i < random_size; ++i){
+            record[i] = (char)(id + seq + i);
+        }
+        if(seq % 2){
+            void* slot = ring->reserve(random_size);
+            memcpy(slot, record.data(), random_size);
+            ring->commit(slot, random_size);
+        }else{
+            ring->write(record.data(), random_size);
+        }
+    }
+}
+
+void multiConsumer(){
+    std::vector<std::size_t> next_seq(kProducers, 0);
+    std::size_t total = (std::size_t)kProducers * kRecordsPerProducer;
+    for(std::size_t idx = 0; idx < total; ++idx){
+        void* buffer = nullptr;
+        std::size_t recv = 0;
+        ring->read(&buffer, recv);
+        std::uint32_t head[2];
+        memcpy(head, buffer, sizeof(head));
+        if((uintptr_t)buffer % ring->align() != 0){
+            printf("Error: record %zu not aligned to %zu\n", idx, ring->align());
+            exit(-2);
+        }
+        if(head[0] >= (std::uint32_t)kProducers || head[1] != next_seq[head[0]]){
+            printf("Error: record %zu out of order\n", idx);
+            exit(-2);
+        }
+        const char* data = static_cast<const char*>(buffer);
+        for(std::size_t i = sizeof(head); i < recv; ++i){
+            if(data[i] != (char)(head[0] + head[1] + i)){
+                printf("Error: %zu-th record is different\n", idx);
+                exit(-2);
+            }
+        }
+        ++next_seq[head[0]];
+        ring->consume();
+    }
+    printf("All %zu records from %d producers verified correct\n", total, kProducers);
+}
+
+void runMultiProducer(const char* name, RingOptions options){
+    printf("\n==== %s ====\n", name);
+    options.multi_producer = true;
+    // small ring so that producers keep wrapping and waiting
+    ring = new RingBuffer(1 << 16, options);
+    std::vector<std::thread> producers;
+    for(int id = 0; id < kProducers; ++id){
+        producers.emplace_back(multiProducer, id);
+    }
+    std::thread cons(multiConsumer);
+    for(std::thread& prod : producers){
+        prod.join();
+    }
+    cons.join();
+    delete ring;
+}
+
+const std::size_t kReaders = 3;
+const std::size_t kBroadcastRecords = 1 << 16;
+
+void broadcastProducer(){
+    std::vector<char> record;
+    for(std::size_t seq = 0; seq < kBroadcastRecords; ++seq){
+        std::size_t random_size = sizeof(std::size_t) + rand() % 2048;
+        record.resize(random_size);
+        memcpy(record.data(), &seq, sizeof(seq));
+        for(std::size_t i = sizeof(seq); i < random_size; ++i){
+            record[i] = (char)(seq + i);
+        }
+        ring->write(record.data(), random_size);
+    }
+}
+
+void broadcastReader(std::size_t reader){
+    for(std::size_t seq = 0; seq < kBroadcastRecords; ++seq){
+        void* buffer = nullptr;
+        std::size_t recv = 0;
+        ring->read(reader, &buffer, recv);
+        const char* data = static_cast<const char*>(buffer);
+        std::size_t got = 0;
+        memcpy(&got, data, sizeof(got));
+        if(got != seq){
+            printf("Error: reader %zu got record %zu, expected %zu\n", reader, got, seq);
+            exit(-2);
+        }
+        for(std::size_t i = sizeof(seq); i < recv; ++i){
+            if(data[i] != (char)(seq + i)){
+                printf("Error: reader %zu %zu-th record is different\n", reader, seq);
+                exit(-2);
+            }
+        }
+        // the last reader lags behind and holds the others back
+        if(reader == kReaders - 1 && seq % 1024 == 0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        ring->consume(reader);
+    }
+}
+
+void runBroadcast(const char* name, RingOptions options){
+    printf("\n==== %s ====\n", name);
+    options.readers = kReaders;
+    ring = new RingBuffer(1 << 18, options);
+    std::thread prod(broadcastProducer);
+    std::vector<std::thread> readers;
+    for(std::size_t reader = 0; reader < kReaders; ++reader){
+        readers.emplace_back(broadcastReader, reader);
+    }
+    prod.join();
+    for(std::thread& reader : readers){
+        reader.join();
+    }
+    printf("All %zu records verified correct by %zu readers\n", kBroadcastRecords, kReaders);
+    delete ring;
+}
+
+const std::size_t kSharedRecords = 1 << 16;
+
+// consumer process: check records in order, restarting itself once
+// with a record read but not consumed, which must be read again
+int sharedConsumer(const RingOptions& options){
+    RingBuffer* shared = new RingBuffer(0, options);
+    for(std::size_t seq = 0; seq < kSharedRecords; ++seq){
+        void* buffer = nullptr;
+        std::size_t recv = 0;
+        shared->read(&buffer, recv);
+        std::size_t got = 0;
+        memcpy(&got, buffer, sizeof(got));
+        if(got != seq || recv != sizeof(got) + seq % 512){
+            printf("Error: shared consumer got record %zu, expected %zu\n", got, seq);
+            return -2;
+        }
+        if(seq == kSharedRecords / 2){
+            // "crash" before consuming, then attach again
+            delete shared;
+            shared = new RingBuffer(0, options);
+            shared->read(&buffer, recv);
+            memcpy(&got, buffer, sizeof(got));
+            if(got != seq){
+                printf("Error: record %zu was not delivered again after restart\n", seq);
+                return -2;
+            }
+        }
+        shared->consume();
+    }
+    delete shared;
+    return 0;
+}
+
+void runShared(const char* name, RingOptions options){
+    printf("\n==== %s ====\n", name);
+    options.shm_name = "/toys_test_ringbuff";
+    RingBuffer::unlink(options.shm_name);
+    ring = new RingBuffer(1 << 16, options);
+
+    pid_t pid = fork();
+    if(pid == 0){
+        _exit(sharedConsumer(options));
+    }
+    std::vector<char> record;
+    for(std::size_t seq = 0; seq < kSharedRecords; ++seq){
+        record.resize(sizeof(seq) + seq % 512);
+        memcpy(record.data(), &seq, sizeof(seq));
+        ring->write(record.data(), record.size());
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    delete ring;
+    RingBuffer::unlink(options.shm_name);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        printf("Error: shared consumer process failed\n");
+        exit(-2);
+    }
+    printf("All %zu records verified correct across processes\n", kSharedRecords);
+}
+
+// segments no ring set up, zeroed as if the creator died or filled
+// with a foreign layout: attaching gives up instead of hanging
+void runStaleShared(){
+    printf("\n==== shared stale ====\n");
+    RingOptions options;
+    options.shm_name = "/toys_test_stale";
+    for(int fill = 0; fill < 2; ++fill){
+        RingBuffer::unlink(options.shm_name);
+        int fd = shm_open(options.shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if(fd < 0 || ftruncate(fd, 1 << 20) != 0){
+            printf("Error: can't create stale segment\n");
+            exit(-2);
+        }
+        if(fill){
+            std::vector<char> junk(4096, 0x5a);
+            if(write(fd, junk.data(), junk.size()) != (ssize_t)junk.size()){
+                printf("Error: can't fill stale segment\n");
+                exit(-2);
+            }
+        }
+        close(fd);
+        try{
+            RingBuffer stale(1 << 16, options);
+            printf("Error: attached to a segment without a ring\n");
+            exit(-2);
+        }catch(const std::runtime_error&){
+        }
+    }
+    RingBuffer::unlink(options.shm_name);
+    printf("Stale and foreign segments refused\n");
+}
+
+const std::size_t kEventRings = 4;
+const std::size_t kEventRecords = 1 << 15;
+
+// producer thread that never blocks: on a full ring it waits for
+// `writeFd` with epoll, then tries again
+void eventProducer(RingBuffer* target){
+    int ep = epoll_create1(0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = target;
+    epoll_ctl(ep, EPOLL_CTL_ADD, target->writeFd(), &ev);
+    for(std::size_t seq = 0; seq < kEventRecords;){
+        if(target->try_write(&seq, sizeof(seq))){
+            ++seq;
+            continue;
+        }
+        epoll_wait(ep, &ev, 1, -1);
+    }
+    close(ep);
+}
+
+void runEventLoop(const char* name, RingOptions options){
+    printf("\n==== %s ====\n", name);
+    options.event_fds = true;
+    std::vector<std::unique_ptr<RingBuffer>> rings;
+    for(std::size_t i = 0; i < kEventRings; ++i){
+        rings.emplace_back(new RingBuffer(1 << 10, options));
+    }
+
+    // nothing written yet: timed calls give up
+    void* buffer = nullptr;
+    std::size_t recv = 0;
+    if(rings[0]->try_read(&buffer, recv) ||
+       rings[0]->read_for(&buffer, recv, std::chrono::milliseconds(10))){
+        printf("Error: read from an empty ring\n");
+        exit(-2);
+    }
+
+    // one thread multiplexes every ring's `readFd`
+    int ep = epoll_create1(0);
+    for(std::size_t i = 0; i < kEventRings; ++i){
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, rings[i]->readFd(), &ev);
+    }
+    std::vector<std::thread> prods;
+    for(std::size_t i = 0; i < kEventRings; ++i){
+        prods.emplace_back(eventProducer, rings[i].get());
+    }
+    std::vector<std::size_t> next(kEventRings, 0);
+    std::size_t done = 0;
+    while(done < kEventRings){
+        for(std::size_t i = 0; i < kEventRings; ++i){
+            while(next[i] < kEventRecords && rings[i]->try_read(&buffer, recv)){
+                std::size_t got = 0;
+                memcpy(&got, buffer, sizeof(got));
+                if(got != next[i] || recv != sizeof(got)){
+                    printf("Error: ring %zu got record %zu, expected %zu\n", i, got, next[i]);
+                    exit(-2);
+                }
+                rings[i]->consume();
+                if(++next[i] == kEventRecords){
+                    ++done;
+                }
+            }
+        }
+        struct epoll_event events[kEventRings];
+        if(done < kEventRings){
+            epoll_wait(ep, events, kEventRings, -1);
+        }
+    }
+    close(ep);
+    for(std::thread& prod : prods){
+        prod.join();
+    }
+
+    // ring 0 is empty again: fill it until a write gives up
+    std::size_t written = 0;
+    while(rings[0]->try_write(&written, sizeof(written))){
+        ++written;
+    }
+    if(rings[0]->write_for(&written, sizeof(written), std::chrono::milliseconds(10))){
+        printf("Error: wrote into a full ring\n");
+        exit(-2);
+    }
+    printf("All %zu records of %zu rings verified correct by one event loop\n",
+           kEventRecords, kEventRings);
+}
+
+const std::size_t kOverwriteRecords = 1 << 18;
+
+// the producer never waits on a small lossy ring while the reader is
+// slow at times: every record that arrives must be intact and in
+// order, and the sequence gaps must match the dropped records
+void runOverwrite(const char* name, RingOptions options){
+    printf("\n==== %s ====\n", name);
+    options.overwrite = true;
+    ring = new RingBuffer(1 << 16, options);
+    std::atomic<bool> ack(false);
+    std::thread prod([&] {
+        std::vector<char> record;
+        for(std::size_t seq = 0; seq < kOverwriteRecords; ++seq){
+            record.resize(sizeof(seq) + seq % 512);
+            memcpy(record.data(), &seq, sizeof(seq));
+            for(std::size_t i = sizeof(seq); i < record.size(); ++i){
+                record[i] = (char)(seq + i);
+            }
+            ring->write(record.data(), record.size());
+        }
+        // empty end markers may be dropped too, repeat until seen
+        while(!ack.load()){
+            ring->write(record.data(), 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    RingRecord records[kBatchSize];
+    std::size_t received = 0;
+    std::uint64_t expected = 0;
+    while(!ack.load()){
+        std::size_t count = 1;
+        if(received % 3 == 0){
+            count = ring->readBatch(records, kBatchSize);
+        }else{
+            ring->read(&records[0].buffer, records[0].size);
+            // plain reads don't report the sequence, take it from the payload
+            memcpy(&records[0].seq, records[0].buffer, sizeof(records[0].seq));
+        }
+        for(std::size_t i = 0; i < count; ++i){
+            if(records[i].size == 0){
+                ack.store(true);
+                break;
+            }
+            std::size_t got = 0;
+            memcpy(&got, records[i].buffer, sizeof(got));
+            if((uintptr_t)records[i].buffer % ring->align() != 0 ||
+               got != records[i].seq || got < expected ||
+               records[i].size != sizeof(got) + got % 512){
+                printf("Error: got record %zu (seq %zu), expected at least %zu\n",
+                       got, (std::size_t)records[i].seq, (std::size_t)expected);
+                exit(-2);
+            }
+            for(std::size_t j = sizeof(got); j < records[i].size; ++j){
+                if(static_cast<char*>(records[i].buffer)[j] != (char)(got + j)){
+                    printf("Error: record %zu was overwritten while held\n", got);
+                    exit(-2);
+                }
+            }
+            expected = got + 1;
+            ++received;
+        }
+        if(received % 5 == 0){
+            // slow reader, let the producer lap it
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        ring->consumeN(count);
+    }
+    prod.join();
+    // every record before the first end marker seen arrived or was dropped
+    std::size_t lost = kOverwriteRecords - received;
+    if(ring->dropped() < lost){
+        printf("Error: %zu records lost but only %zu counted as dropped\n", lost,
+               (std::size_t)ring->dropped());
+        exit(-2);
+    }
+    printf("%zu records received, %zu dropped, all verified correct\n", received, lost);
+    delete ring;
+}
+
+const std::size_t kFdBytes = 1 << 26;
+
+char fdByte(std::size_t i){
+    return (char)(i * 7 + (i >> 12));
+}
+
+void runFdPassThrough(const char* name, const RingOptions& options){
+    printf("\n==== %s ====\n", name);
+    ring = new RingBuffer(1 << 16, options);
+    int in[2];
+    int out[2];
+    if(pipe(in) != 0 || pipe(out) != 0){
+        printf("Error: pipe failed\n");
+        exit(-2);
+    }
+    std::thread feeder([&] {
+        unsigned seed = 1;
+        std::vector<char> chunk;
+        for(std::size_t sent = 0; sent < kFdBytes;){
+            chunk.resize(std::min(kFdBytes - sent, (std::size_t)(rand_r(&seed) % 20000 + 1)));
+            for(std::size_t i = 0; i < chunk.size(); ++i){
+                chunk[i] = fdByte(sent + i);
+            }
+            for(std::size_t ofs = 0; ofs < chunk.size();){
+                ssize_t n = write(in[1], chunk.data() + ofs, chunk.size() - ofs);
+                if(n <= 0){
+                    printf("Error: pipe write failed\n");
+                    exit(-2);
+                }
+                ofs += n;
+            }
+            sent += chunk.size();
+        }
+        close(in[1]);
+    });
+    std::thread filler([&] {
+        unsigned seed = 2;
+        // vary the limit so records end everywhere around the wrap
+        while(ring->fillFromFd(in[0], rand_r(&seed) % 30000 + 1) > 0){
+        }
+    });
+    std::thread drainer([&] {
+        for(std::size_t drained = 0; drained < kFdBytes;){
+            ssize_t n = ring->drainToFd(out[1]);
+            if(n < 0){
+                printf("Error: drainToFd failed\n");
+                exit(-2);
+            }
+            drained += n;
+        }
+        close(out[1]);
+    });
+    std::vector<char> chunk(1 << 16);
+    std::size_t received = 0;
+    ssize_t n = 0;
+    while((n = read(out[0], chunk.data(), chunk.size())) > 0){
+        for(ssize_t i = 0; i < n; ++i){
+            if(chunk[i] != fdByte(received + i)){
+                printf("Error: byte %zu is different\n", received + i);
+                exit(-2);
+            }
+        }
+        received += n;
+    }
+    feeder.join();
+    filler.join();
+    drainer.join();
+    close(in[0]);
+    close(out[0]);
+    if(received != kFdBytes){
+        printf("Error: %zu of %zu bytes passed through\n", received, kFdBytes);
+        exit(-2);
+    }
+    printf("All %zu bytes passed through fd to fd correct\n", received);
+    delete ring;
+}
+
+const std::size_t kOutOfOrderRounds = 256;
+
+// fill the ring, read everything and consume it in random order:
+// space must stay held while the oldest record is, and all of it
+// come back together with the oldest one
+void runOutOfOrder(const char* name, const RingOptions& options){
+    printf("\n==== %s ====\n", name);
+    ring = new RingBuffer(1 << 16, options);
+    unsigned seed = 5;
+    std::vector<char> record(4096);
+    std::size_t records = 0;
+    for(std::size_t round = 0; round < kOutOfOrderRounds; ++round){
+        std::size_t sent = 0;
+        while(true){
+            std::size_t size = sizeof(sent) + 1 + rand_r(&seed) % 2000;
+            memcpy(record.data(), &sent, sizeof(sent));
+            record[size - 1] = (char)sent;
+            if(!ring->try_write(record.data(), size)){
+                break;
+            }
+            ++sent;
+        }
+        std::vector<RingRecord> held(sent);
+        for(std::size_t got = 0; got < sent;){
+            got += ring->readBatch(held.data() + got, sent - got);
+        }
+        for(std::size_t i = 0; i < sent; ++i){
+            std::size_t seq = 0;
+            memcpy(&seq, held[i].buffer, sizeof(seq));
+            if(seq != i || static_cast<char*>(held[i].buffer)[held[i].size - 1] != (char)i){
+                printf("Error: got record %zu, expected %zu\n", seq, i);
+                exit(-2);
+            }
+        }
+        std::vector<std::size_t> order;
+        for(std::size_t i = 1; i < sent; ++i){
+            order.push_back(i);
+        }
+        std::shuffle(order.begin(), order.end(), std::minstd_rand(seed));
+        for(std::size_t i : order){
+            ring->consumeBuffer(held[i].buffer);
+        }
+        // the oldest record still holds all of the space
+        if(ring->try_write(record.data(), 1 << 12)){
+            printf("Error: space released in front of a held record\n");
+            exit(-2);
+        }
+        if(round % 2){
+            ring->consumeBuffer(held[0].buffer);
+        }else{
+            ring->consume();
+        }
+        for(std::size_t i = 0; i < 8; ++i){
+            if(!ring->try_write(record.data(), 1 << 12)){
+                printf("Error: space not released after the oldest record\n");
+                exit(-2);
+            }
+        }
+        void* buffer = nullptr;
+        std::size_t size = 0;
+        for(std::size_t i = 0; i < 8; ++i){
+            ring->read(&buffer, size);
+        }
+        ring->consumeN(8);
+        records += sent + 8;
+    }
+    void* buffer = nullptr;
+    std::size_t size = 0;
+    if(ring->try_read(&buffer, size)){
+        printf("Error: read from an empty ring\n");
+        exit(-2);
+    }
+#if CHANNEL_STATS
+    if(ring->stats().records_out != records){
+        printf("Error: %zu of %zu records counted out\n",
+               (std::size_t)ring->stats().records_out, records);
+        exit(-2);
+    }
+    // only polls that found the ring full or empty, never a wait
+    if(ring->stats().write_waits != 0 || ring->stats().read_waits != 0){
+        printf("Error: polls counted as %zu write and %zu read waits\n",
+               (std::size_t)ring->stats().write_waits, (std::size_t)ring->stats().read_waits);
+        exit(-2);
+    }
+#endif
+    printf("All %zu records consumed out of order\n", records);
+    delete ring;
+}
+
+int main(){
+    srand((unsigned)time(NULL));
+    run("malloc", RingOptions(), 1 << 30);
+
+    RingOptions mirrored;
+    mirrored.backend = RingBackend::kMirrored;
+    run("mirrored", mirrored, 1 << 28);
+
+    RingOptions placed;
+    placed.placement.huge_pages = HugePages::kTransparent;
+    placed.placement.prefault = true;
+    placed.placement.numa_node = currentNumaNode();
+    run("placed", placed, 1 << 28);
+
+    const WaitStrategy strategies[] = {WaitStrategy::kBlocking, WaitStrategy::kSpin,
+                                       WaitStrategy::kSpinYield};
+    const char* strategy_names[] = {"wait blocking", "wait spin", "wait spin-yield"};
+    for(int i = 0; i < 3; ++i){
+        RingOptions waiting;
+        waiting.wait = strategies[i];
+        run(strategy_names[i], waiting, 1 << 26);
+    }
+
+    RingOptions aligned;
+    aligned.align = 64;
+    run("aligned 64", aligned, 1 << 26);
+    RingOptions page_aligned = mirrored;
+    page_aligned.align = sysconf(_SC_PAGESIZE);
+    run("aligned page mirrored", page_aligned, 1 << 26);
+
+    runMultiProducer("multi-producer malloc", RingOptions());
+    runMultiProducer("multi-producer mirrored", mirrored);
+    runMultiProducer("multi-producer aligned 64", aligned);
+
+    runBroadcast("broadcast malloc", RingOptions());
+    runBroadcast("broadcast mirrored", mirrored);
+
+    runOverwrite("overwrite malloc", RingOptions());
+    runOverwrite("overwrite mirrored", mirrored);
+    RingOptions aligned_overwrite;
+    aligned_overwrite.align = 16;
+    runOverwrite("overwrite aligned 16", aligned_overwrite);
+
+    runEventLoop("event loop malloc", RingOptions());
+    runEventLoop("event loop mirrored", mirrored);
+
+    runFdPassThrough("fd pass-through malloc", RingOptions());
+    runFdPassThrough("fd pass-through mirrored", mirrored);
+    runFdPassThrough("fd pass-through aligned 64", aligned);
+
+    runOutOfOrder("out of order malloc", RingOptions());
+    runOutOfOrder("out of order mirrored", mirrored);
+    runOutOfOrder("out of order aligned 64", aligned);
+
+    runShared("shared malloc", RingOptions());
+    runShared("shared mirrored", mirrored);
+    RingOptions shared_multi;
+    shared_multi.multi_producer = true;
+    runShared("shared multi-producer", shared_multi);
+    runStaleShared();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include <typedring.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+
+const std::size_t kRecords = 1 << 22;
+
+struct Record {
+    std::size_t seq;
+    std::uint32_t check;
+    char payload[52];
+};
+
+// counts live copies, to check every record is destroyed exactly once
+struct Tracked {
+    static std::atomic<long> live;
+    std::string text;
+    explicit Tracked(std::size_t seq): text(std::to_string(seq)) { ++live; }
+    Tracked(Tracked&& other): text(std::move(other.text)) { ++live; }
+    Tracked& operator=(Tracked&& other) { text = std::move(other.text); return *this; }
+    ~Tracked() { --live; }
+};
+std::atomic<long> Tracked::live(0);
+
+template <typename Ring>
+void runRecords(const char* name, Ring* ring){
+    printf("\n==== %s ====\n", name);
+    std::thread prod([&] {
+        for(std::size_t seq = 0; seq < kRecords; ++seq){
+            Record record;
+            record.seq = seq;
+            record.check = (std::uint32_t)(seq * 2654435761u);
+            record.payload[seq % sizeof(record.payload)] = (char)seq;
+            if(seq % 2){
+                ring->push(record);
+            }else if(!ring->try_push(record)){
+                // full: fall back to the blocking push
+                ring->push(record);
+            }
+        }
+    });
+    for(std::size_t seq = 0; seq < kRecords;){
+        // drain whatever is ready, then release it in one go
+        std::size_t count = 0;
+        Record* record = &ring->read();
+        do{
+            if(record->seq != seq + count ||
+               record->check != (std::uint32_t)((seq + count) * 2654435761u) ||
+               record->payload[record->seq % sizeof(record->payload)] != (char)record->seq){
+                printf("Error: got record %zu, expected %zu\n", record->seq, seq + count);
+                exit(-2);
+            }
+            ++count;
+        }while(count < 64 && ring->try_read(&record));
+        ring->consumeN(count);
+        seq += count;
+    }
+    prod.join();
+    printf("All %zu records verified correct\n", kRecords);
+    delete ring;
+}
+
+void runTracked(){
+    printf("\n==== tracked ====\n");
+    TypedRing<Tracked, 1024>* ring = new TypedRing<Tracked, 1024>();
+    std::thread prod([&] {
+        for(std::size_t seq = 0; seq < kRecords / 16; ++seq){
+            ring->emplace(seq);
+        }
+    });
+    for(std::size_t seq = 0; seq < kRecords / 16; ++seq){
+        Tracked item(0);
+        ring->pop(item);
+        if(item.text != std::to_string(seq)){
+            printf("Error: got record %s, expected %zu\n", item.text.c_str(), seq);
+            exit(-2);
+        }
+    }
+    prod.join();
+
+    // records left in the ring are destroyed with it
+    for(std::size_t seq = 0; seq < 100; ++seq){
+        ring->emplace(seq);
+    }
+    ring->read();
+    Tracked* item = nullptr;
+    if(ring->read_for(&item, std::chrono::milliseconds(1)) == false ||
+       item->text != "1"){
+        printf("Error: second record not readable\n");
+        exit(-2);
+    }
+    ring->consume();
+    // consuming more than was read stops at the records read
+    ring->consumeN(5);
+    if(Tracked::live != 98 || ring->read().text != "2"){
+        printf("Error: consumed records that were not read, %ld live\n", (long)Tracked::live);
+        exit(-2);
+    }
+    delete ring;
+    if(Tracked::live != 0){
+        printf("Error: %ld records not destroyed\n", (long)Tracked::live);
+        exit(-2);
+    }
+    printf("All records moved through and destroyed once\n");
+}
+
+int main(){
+    runRecords("spin-futex", new TypedRing<Record, 4096>());
+    runRecords("blocking", new TypedRing<Record, 4096>(WaitStrategy::kBlocking));
+    runRecords("spin-yield", new TypedRing<Record, 64>(WaitStrategy::kSpinYield));
+    runTracked();
+    return 0;
+}